@@ -23,18 +23,605 @@
  *
  */
 
+#include <stdio.h>
 #include "bsp/board.h"
 #include "tusb.h"
 #include "winc_flash.h"
 #include "class/msc/msc_device.h"
 #include "device/usbd.h"
 #include "winc_wifi.h"
+#include "msc_disk.h"
+#include "winc_kv.h"
+#include "winc_log.h"
+#ifdef USE_MSC_FTL
+#include "winc_ftl.h"
+#endif
 
 #if CFG_TUD_MSC
 
 // whether host does safe-eject
 static bool ejected = false;
 
+#ifndef SCSI_CMD_SYNCHRONIZE_CACHE_10
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+#endif
+#ifndef SCSI_CMD_UNMAP
+#define SCSI_CMD_UNMAP                  0x42
+#endif
+#define SCSI_CMD_SERVICE_ACTION_IN_16   0x9e
+#define SCSI_SA_READ_CAPACITY_16        0x10
+
+//--------------------------------------------------------------------+
+// Sector cache
+//--------------------------------------------------------------------+
+
+// Cached copy of one flash sector. A sector being written need not be
+// read first; 'have' marks the logical blocks present, the rest are
+// merged from flash when the sector is read or written back
+typedef struct {
+  uint32_t sector;
+  uint32_t used;      // tick of last access, for LRU replacement
+  bool valid;
+  bool dirty;         // modified, not yet written to flash
+  uint8_t have;       // bitmap of logical blocks present
+  uint8_t data[MSC_SECTOR_SIZE];
+} msc_cache_t;
+
+#define HAVE_ALL  ((1 << MSC_SECTOR_BLOCKS) - 1)
+
+static msc_cache_t cache[MSC_CACHE_MAX];
+static int cache_size = MSC_CACHE_SIZE;
+static uint32_t cache_tick, last_sector = (uint32_t)-1, last_write;
+static uint8_t flash_buff[MSC_SECTOR_SIZE];
+static msc_stats_t stats;
+
+#ifndef USE_MSC_FTL
+// Free-sector tracking: logical blocks unmapped by the host, and sectors
+// known to be erased. Fully-unmapped sectors are erased in the background,
+// so a later write to them only needs page programming
+static uint8_t unmapped[MSC_MAX_SECTORS];
+static uint8_t erased[MSC_MAX_SECTORS / 8];
+static uint32_t erase_pending, erase_next;
+
+#define IS_ERASED(s)    (erased[(s) / 8] & (1 << ((s) % 8)))
+#define SET_ERASED(s)   (erased[(s) / 8] |= 1 << ((s) % 8))
+#define CLR_ERASED(s)   (erased[(s) / 8] &= ~(1 << ((s) % 8)))
+
+// Return true if sector data is all 0xff
+static bool sector_blank(uint8_t *buff)
+{
+  for (int i=0; i<MSC_SECTOR_SIZE; i++)
+  {
+    if (buff[i] != 0xff) return false;
+  }
+  return true;
+}
+#endif
+
+// Return size of flash area used for disk, in bytes
+static uint32_t msc_flash_size(void)
+{
+  // Top of flash is reserved for the key-value store & event log
+  return spi_flash_get_size(g_spi_fd) * 1024 * 1024 / 8 - KV_SIZE - LOG_SIZE;
+}
+
+// Prepare disk for use. With the FTL, the disk is in the application
+// area above the WINC firmware, and must have been formatted
+bool msc_disk_init(void)
+{
+#ifdef USE_MSC_FTL
+  if (spi_flash_get_size(g_spi_fd) * 1024 * 1024 / 8 < FLASH_USER_MIN) return false;
+  return ftl_init(g_spi_fd, FLASH_FTL_BASE, msc_flash_size() - FLASH_FTL_BASE);
+#else
+  return true;
+#endif
+}
+
+// Format disk, discarding all data (only possible with the FTL)
+bool msc_disk_format(void)
+{
+#ifdef USE_MSC_FTL
+  if (spi_flash_get_size(g_spi_fd) * 1024 * 1024 / 8 < FLASH_USER_MIN) return false;
+  memset(cache, 0, sizeof(cache));
+  last_sector = (uint32_t)-1;
+  last_write = 0;
+  return ftl_format(g_spi_fd, FLASH_FTL_BASE, msc_flash_size() - FLASH_FTL_BASE);
+#else
+  return false;
+#endif
+}
+
+// Return size of disk in bytes
+uint32_t msc_disk_size(void)
+{
+#ifdef USE_MSC_FTL
+  return ftl_sectors() * MSC_SECTOR_SIZE;
+#else
+  return msc_flash_size();
+#endif
+}
+
+// Read disk sector from flash
+static bool sector_read(uint32_t sector, uint8_t *buff)
+{
+#ifdef USE_MSC_FTL
+  return ftl_read(sector, buff);
+#else
+  if (sector < MSC_MAX_SECTORS && IS_ERASED(sector))
+  {
+    memset(buff, 0xff, MSC_SECTOR_SIZE);
+    stats.pre_erased++;
+    return true;
+  }
+  if (spi_flash_read(g_spi_fd, buff, sector * MSC_SECTOR_SIZE, MSC_SECTOR_SIZE) != M2M_SUCCESS)
+    return false;
+  if (sector < MSC_MAX_SECTORS && sector_blank(buff))
+    SET_ERASED(sector);
+  return true;
+#endif
+}
+
+#ifndef USE_MSC_FTL
+// Note that sector is about to be written, so is no longer erased
+static bool sector_write_start(uint32_t sector)
+{
+  if (sector < MSC_MAX_SECTORS)
+    CLR_ERASED(sector);
+  return true;
+}
+#endif
+
+// Write disk sector to flash, given its current contents
+static bool sector_write(uint32_t sector, uint8_t *buff, uint8_t *old)
+{
+#ifdef USE_MSC_FTL
+  return memcmp(buff, old, MSC_SECTOR_SIZE) == 0 || ftl_write(sector, buff);
+#else
+  return sector_write_start(sector) &&
+         spi_flash_rewrite_sector(g_spi_fd, buff, old, sector * MSC_SECTOR_SIZE) == M2M_SUCCESS;
+#endif
+}
+
+#ifndef USE_MSC_FTL
+// Sector being written back in steps from msc_task, null if none.
+// flash_buff holds its old contents, so any other use of flash_buff
+// abandons the write-back; the entry stays dirty, and is written
+// again later, compared with what is then in flash
+static msc_cache_t *flush_cp;
+static FLASH_REWRITE flush_rw;
+
+// Abandon write-back in progress, letting any erase it started finish
+static void flush_abandon(void)
+{
+  if (flush_cp != NULL)
+    spi_flash_rewrite_abort(g_spi_fd, &flush_rw);
+  flush_cp = NULL;
+}
+#endif
+
+// Read sector from flash into flash_buff, and use it to fill in
+// the logical blocks not present in cache entry
+static bool cache_fill(msc_cache_t *cp)
+{
+#ifndef USE_MSC_FTL
+  flush_abandon();
+#endif
+  if (!sector_read(cp->sector, flash_buff))
+    return false;
+  for (int i=0; i<MSC_SECTOR_BLOCKS; i++)
+  {
+    if (!(cp->have & (1 << i)))
+      memcpy(&cp->data[i * MSC_BLOCK_SIZE], &flash_buff[i * MSC_BLOCK_SIZE], MSC_BLOCK_SIZE);
+  }
+  cp->have = HAVE_ALL;
+  return true;
+}
+
+// Write dirty sector back to flash, erasing & programming only as needed
+// If this fails, the entry stays dirty
+static bool cache_flush_entry(msc_cache_t *cp)
+{
+  uint32_t t = usec();
+  bool ok;
+
+  if (!cp->valid || !cp->dirty) return true;
+  ok = cache_fill(cp) && sector_write(cp->sector, cp->data, flash_buff);
+  if (ok) cp->dirty = false;
+  stats.wr_usec += usec() - t;
+  return ok;
+}
+
+// Write all dirty sectors back to flash
+bool msc_flush(void)
+{
+  bool ok = true;
+
+  for (int i=0; i<MSC_CACHE_MAX; i++)
+    ok = cache_flush_entry(&cache[i]) && ok;
+  return ok;
+}
+
+// Set number of cache entries, and discard cached data. The flash may
+// have been changed directly, so free-sector tracking is also reset
+void msc_cache_init(int nsectors)
+{
+  msc_flush();
+  cache_size = MAX(1, MIN(nsectors, MSC_CACHE_MAX));
+  memset(cache, 0, sizeof(cache));
+  last_sector = (uint32_t)-1;
+#ifndef USE_MSC_FTL
+  flush_abandon();
+  memset(unmapped, 0, sizeof(unmapped));
+  memset(erased, 0, sizeof(erased));
+  erase_pending = 0;
+#endif
+}
+
+// Return cache entry for sector, null if not cached
+static msc_cache_t *cache_find(uint32_t sector)
+{
+  for (int i=0; i<cache_size; i++)
+  {
+    if (cache[i].valid && cache[i].sector == sector) return &cache[i];
+  }
+  return NULL;
+}
+
+// Return unused entry, or least-recently used, after writing it back
+// Return null if the write-back failed
+static msc_cache_t *cache_victim(void)
+{
+  msc_cache_t *cp = &cache[0];
+
+  for (int i=0; i<cache_size; i++)
+  {
+    if (!cache[i].valid) return &cache[i];
+    if (cache_tick - cache[i].used > cache_tick - cp->used) cp = &cache[i];
+  }
+  if (!cache_flush_entry(cp)) return NULL;
+  cp->valid = false;
+  return cp;
+}
+
+// Allocate cache entry for sector, without reading flash
+// Return null if no entry could be freed
+static msc_cache_t *cache_alloc(uint32_t sector)
+{
+  msc_cache_t *cp = cache_victim();
+
+  if (cp == NULL) return NULL;
+  cp->sector = sector;
+  cp->used = cache_tick;
+  cp->have = 0;
+  cp->dirty = false;
+  cp->valid = true;
+  return cp;
+}
+
+// Load sector from flash into cache, return entry (null if error)
+static msc_cache_t *cache_load(uint32_t sector)
+{
+  msc_cache_t *cp = cache_alloc(sector);
+
+  if (cp == NULL) return NULL;
+  if (!cache_fill(cp))
+  {
+    cp->valid = false;
+    return NULL;
+  }
+  return cp;
+}
+
+#ifndef USE_MSC_FTL
+static msc_cache_t *stream_entries[1 + MSC_READ_AHEAD];
+
+// Handler for streamed read, copy sector into its cache entry
+static bool cache_stream_handler(void *ctx, uint32_t addr, uint8_t *data, uint32_t len)
+{
+  msc_cache_t *cp = stream_entries[addr / MSC_SECTOR_SIZE - *(uint32_t *)ctx];
+
+  memcpy(cp->data, data, len);
+  cp->have = HAVE_ALL;
+  return true;
+}
+
+// Load sector and the following uncached ones with a single streamed
+// read, so flash loads overlap the SPI transfers. Return first entry
+static msc_cache_t *cache_stream(uint32_t sector, uint32_t nsectors)
+{
+  uint32_t n = 0;
+
+  flush_abandon();
+  while (n <= MSC_READ_AHEAD && n < (uint32_t)cache_size && sector + n < nsectors &&
+         (n == 0 || !cache_find(sector + n)))
+  {
+    if ((stream_entries[n] = cache_alloc(sector + n)) == NULL) break;
+    n++;
+  }
+  if (n == 0) return NULL;
+  if (spi_flash_read_stream(g_spi_fd, sector * MSC_SECTOR_SIZE, n * MSC_SECTOR_SIZE, flash_buff,
+                            MSC_SECTOR_SIZE, cache_stream_handler, &sector) != M2M_SUCCESS)
+  {
+    for (uint32_t i=0; i<n; i++)
+    {
+      if (stream_entries[i]->have != HAVE_ALL) stream_entries[i]->valid = false;
+    }
+  }
+  for (uint32_t i=1; i<n; i++)
+  {
+    if (stream_entries[i]->valid) stats.read_ahead++;
+  }
+  return stream_entries[0]->valid ? stream_entries[0] : NULL;
+}
+#endif
+
+// Return cache entry for sector, loading it if necessary.
+// On a sequential miss, also load the following sectors
+static msc_cache_t *cache_get(uint32_t sector)
+{
+  uint32_t nsectors = msc_disk_size() / MSC_SECTOR_SIZE;
+  msc_cache_t *cp;
+  bool seq = (sector == last_sector + 1);
+
+  cache_tick++;
+  last_sector = sector;
+  if ((cp = cache_find(sector)) != NULL)
+  {
+    stats.hits++;
+    cp->used = cache_tick;
+    return cp->have == HAVE_ALL || cache_fill(cp) ? cp : NULL;
+  }
+  stats.misses++;
+#ifndef USE_MSC_FTL
+  if (seq) return cache_stream(sector, nsectors);
+#endif
+  if ((cp = cache_load(sector)) == NULL) return NULL;
+  for (uint32_t n=1; seq && n<=MSC_READ_AHEAD && n<(uint32_t)cache_size && sector+n<nsectors; n++)
+  {
+    if (!cache_find(sector + n) && cache_load(sector + n)) stats.read_ahead++;
+  }
+  return cp;
+}
+
+// Read from disk, via cache
+bool msc_disk_read(uint32_t addr, void *buff, uint32_t len)
+{
+  uint8_t *dp = buff;
+  uint32_t n, oset;
+  msc_cache_t *cp;
+
+  if (addr + len > msc_disk_size()) return false;
+  while (len > 0)
+  {
+    oset = addr % MSC_SECTOR_SIZE;
+    n = MIN(len, MSC_SECTOR_SIZE - oset);
+    if ((cp = cache_get(addr / MSC_SECTOR_SIZE)) == NULL) return false;
+    memcpy(dp, &cp->data[oset], n);
+    addr += n;
+    dp += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Write to disk, via cache; whole logical blocks are stored without
+// reading the flash, partial blocks are merged with the flash data
+bool msc_disk_write(uint32_t addr, const void *buff, uint32_t len)
+{
+  const uint8_t *dp = buff;
+  uint32_t n, oset, sector;
+  msc_cache_t *cp;
+  uint8_t mask;
+
+  if (addr + len > msc_disk_size()) return false;
+  while (len > 0)
+  {
+    sector = addr / MSC_SECTOR_SIZE;
+    oset = addr % MSC_SECTOR_SIZE;
+    n = MIN(len, MSC_SECTOR_SIZE - oset);
+    cache_tick++;
+#ifndef USE_MSC_FTL
+    if (sector < MSC_MAX_SECTORS && unmapped[sector])
+    {
+      if (unmapped[sector] == HAVE_ALL && !IS_ERASED(sector))
+        erase_pending--;
+      unmapped[sector] = 0;
+    }
+#endif
+    if ((cp = cache_find(sector)) == NULL && (cp = cache_alloc(sector)) == NULL)
+      return false;
+#ifndef USE_MSC_FTL
+    if (cp == flush_cp)
+      flush_abandon();
+#endif
+    cp->used = cache_tick;
+    mask = 0;
+    for (uint32_t b=oset/MSC_BLOCK_SIZE; b<=(oset+n-1)/MSC_BLOCK_SIZE; b++)
+      mask |= 1 << b;
+    if ((oset % MSC_BLOCK_SIZE || n % MSC_BLOCK_SIZE) && (cp->have & mask) != mask && !cache_fill(cp))
+      return false;
+    memcpy(&cp->data[oset], dp, n);
+    cp->have |= mask;
+    cp->dirty = true;
+    addr += n;
+    dp += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Return first dirty cache entry, null if none
+static msc_cache_t *cache_dirty(void)
+{
+  for (int i=0; i<MSC_CACHE_MAX; i++)
+  {
+    if (cache[i].valid && cache[i].dirty) return &cache[i];
+  }
+  return NULL;
+}
+
+// Do one step of writing dirty sectors back to flash, so WiFi events
+// can be serviced between steps. Return true if more to do
+static bool msc_flush_step(void)
+{
+  msc_cache_t *cp;
+
+  stats.flush_steps++;
+#ifdef USE_MSC_FTL
+  // FTL writes a whole sector at a time
+  if ((cp = cache_dirty()) == NULL || !cache_flush_entry(cp)) return false;
+#else
+  uint32_t t = usec();
+  int8_t err;
+  bool ok = true;
+
+  // On failure the entry stays dirty; stop until the next write or sync
+  if (flush_cp == NULL)
+  {
+    if ((cp = cache_dirty()) == NULL) return false;
+    if (!cache_fill(cp) || !sector_write_start(cp->sector))
+      ok = false;
+    else
+    {
+      spi_flash_rewrite_start(&flush_rw, cp->data, flash_buff, cp->sector * MSC_SECTOR_SIZE);
+      flush_cp = cp;
+    }
+  }
+  else if ((err = spi_flash_rewrite_step(g_spi_fd, &flush_rw)) != FLASH_STEP_MORE)
+  {
+    if (err == M2M_SUCCESS)
+      flush_cp->dirty = false;
+    else
+    {
+      flush_abandon();
+      ok = false;
+    }
+    flush_cp = NULL;
+  }
+  stats.wr_usec += usec() - t;
+  if (!ok) return false;
+#endif
+  return true;
+}
+
+// Mark logical blocks as unused by the host. Sectors with all their
+// blocks unused are dropped from the cache, and queued for erasure
+// (with the FTL, only sectors entirely within the range are unmapped)
+void msc_disk_unmap(uint32_t block, uint32_t count)
+{
+  msc_cache_t *cp;
+  uint32_t sector;
+
+  stats.unmapped += count;
+#ifndef USE_MSC_FTL
+
+  for (; count > 0; block++, count--)
+  {
+    sector = block / MSC_SECTOR_BLOCKS;
+    if (sector >= MSC_MAX_SECTORS || unmapped[sector] == HAVE_ALL)
+      continue;
+    unmapped[sector] |= 1 << (block % MSC_SECTOR_BLOCKS);
+    if (unmapped[sector] == HAVE_ALL)
+    {
+      if ((cp = cache_find(sector)) != NULL)
+      {
+        if (cp == flush_cp)
+          flush_abandon();
+        cp->valid = cp->dirty = false;
+      }
+      if (!IS_ERASED(sector))
+        erase_pending++;
+    }
+  }
+#else
+  uint32_t end = (block + count) / MSC_SECTOR_BLOCKS;
+
+  for (sector = (block + MSC_SECTOR_BLOCKS - 1) / MSC_SECTOR_BLOCKS; sector < end; sector++)
+  {
+    if ((cp = cache_find(sector)) != NULL)
+      cp->valid = cp->dirty = false;
+    ftl_unmap(sector);
+  }
+#endif
+}
+
+#ifndef USE_MSC_FTL
+// Erase one unused sector, if any are waiting
+static void unmap_task(void)
+{
+  uint32_t nsectors = MIN(msc_disk_size() / MSC_SECTOR_SIZE, MSC_MAX_SECTORS);
+
+  for (uint32_t n=0; erase_pending && n<nsectors; n++)
+  {
+    uint32_t sector = erase_next;
+
+    erase_next = (erase_next + 1) % nsectors;
+    if (unmapped[sector] == HAVE_ALL && !IS_ERASED(sector))
+    {
+      if (spi_flash_erase(g_spi_fd, sector * MSC_SECTOR_SIZE, MSC_SECTOR_SIZE) == M2M_SUCCESS)
+      {
+        SET_ERASED(sector);
+        stats.bg_erases++;
+      }
+      erase_pending--;
+      return;
+    }
+  }
+}
+#endif
+
+// Display cache & throughput statistics
+void msc_stats_print(void)
+{
+  uint32_t total = stats.hits + stats.misses;
+
+  printf("MSC read %lu KB in %lu ms (%lu KB/s), hits %lu misses %lu (%lu%% hit), read-ahead %lu\n",
+         stats.rd_bytes / 1024, stats.rd_usec / 1000,
+         stats.rd_usec ? (uint32_t)(stats.rd_bytes * 1000ULL / stats.rd_usec) : 0,
+         stats.hits, stats.misses, total ? stats.hits * 100 / total : 0, stats.read_ahead);
+  printf("MSC write %lu KB in %lu ms (%lu KB/s), erases %lu (%lu/MB), pages written %lu skipped %lu\n",
+         stats.wr_bytes / 1024, stats.wr_usec / 1000,
+         stats.wr_usec ? (uint32_t)(stats.wr_bytes * 1000ULL / stats.wr_usec) : 0,
+         flash_stats.erases,
+         stats.wr_bytes ? (uint32_t)(flash_stats.erases * 1048576ULL / stats.wr_bytes) : 0,
+         flash_stats.pages_written, flash_stats.pages_skipped);
+  printf("MSC unmapped %lu blocks, background erases %lu, pre-erased sector writes %lu, flush steps %lu\n",
+         stats.unmapped, stats.bg_erases, stats.pre_erased, stats.flush_steps);
+  spi_flash_stats_print();
+#ifdef USE_MSC_FTL
+  ftl_stats_print();
+#endif
+}
+
+// Periodic MSC housekeeping, call from main loop:
+// flush written data when idle, display statistics
+void msc_task(void)
+{
+  static uint32_t stats_ticks, last_total;
+  uint32_t total = stats.hits + stats.misses + stats.wr_bytes + stats.unmapped + stats.bg_erases;
+
+  if (last_write && usec() - last_write > MSC_FLUSH_MSEC * 1000)
+  {
+    // Write back one step at a time, until nothing left
+    if (!msc_flush_step())
+      last_write = 0;
+  }
+#ifdef USE_MSC_FTL
+  // Erase stale sectors when idle
+  else if (!last_write)
+    ftl_task();
+#else
+  // Erase unmapped sectors when idle
+  else if (!last_write)
+    unmap_task();
+#endif
+  if (ustimeout(&stats_ticks, MSC_STATS_MSEC * 1000) && total != last_total)
+  {
+    last_total = total;
+    msc_stats_print();
+  }
+}
+
 // Invoked when received SCSI_CMD_INQUIRY
 // Application fill vendor id, product id and revision for Inquiry response
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
@@ -56,8 +643,8 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 {
   (void) lun;
 
-  // RAM disk is ready until ejected
-  if (ejected) {
+  // Disk is ready until ejected, if it has been formatted
+  if (ejected || msc_disk_size() == 0) {
     tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
     return false;
   }
@@ -71,9 +658,8 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
 {
   (void) lun;
 
-  uint32_t flash_size_mbits = spi_flash_get_size(g_spi_fd);
-  *block_size = 4096;
-  *block_count = (flash_size_mbits * 1024 * 1024) / 8 / *block_size;
+  *block_size = MSC_BLOCK_SIZE;
+  *block_count = msc_disk_size() / MSC_BLOCK_SIZE;
 }
 
 // Invoked when received Start Stop Unit command
@@ -92,7 +678,9 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
     }else
     {
       // unload disk storage
+      msc_flush();
       ejected = true;
+      msc_stats_print();
     }
   }
 
@@ -104,10 +692,12 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
 {
   (void) lun;
-  (void) offset;
 
-  uint32_t addr = lba * 4096;
-  spi_flash_read(g_spi_fd, buffer, addr, bufsize);
+  uint32_t addr = lba * MSC_BLOCK_SIZE + offset, t = usec();
+
+  if (!msc_disk_read(addr, buffer, bufsize)) return -1;
+  stats.rd_bytes += bufsize;
+  stats.rd_usec += usec() - t;
 
   return bufsize;
 }
@@ -117,11 +707,13 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buff
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
 {
     (void) lun;
-    (void) offset;
 
-    uint32_t addr = lba * 4096;
-    spi_flash_erase(g_spi_fd, addr, bufsize);
-    spi_flash_write(g_spi_fd, buffer, addr, bufsize);
+    uint32_t addr = lba * MSC_BLOCK_SIZE + offset, t = usec();
+
+    if (!msc_disk_write(addr, buffer, bufsize)) return -1;
+    last_write = usec();
+    stats.wr_bytes += bufsize;
+    stats.wr_usec += last_write - t;
 
     return bufsize;
 }
@@ -133,8 +725,6 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 {
   // read10 & write10 has their own callback and MUST not be handled here
   (void) lun;
-  (void) buffer;
-  (void) bufsize;
 
   int32_t resplen = 0;
 
@@ -145,6 +735,62 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
       resplen = 0;
     break;
 
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+      // Write cached sectors back to flash
+      if (!msc_flush())
+      {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0c, 0x00);
+        resplen = -1;
+      }
+    break;
+
+    case SCSI_CMD_UNMAP:
+      // Parameter list: 8-byte header, then 16-byte block descriptors
+      // of 64-bit LBA & 32-bit count, big-endian
+      {
+        uint8_t const *p = buffer;
+        uint32_t nblocks = msc_disk_size() / MSC_BLOCK_SIZE;
+        uint32_t dlen = bufsize >= 8 ? tu_min32((p[2] << 8) | p[3], bufsize - 8) : 0;
+
+        for (p += 8; dlen >= 16; p += 16, dlen -= 16)
+        {
+          uint32_t lba = tu_u32(p[4], p[5], p[6], p[7]);
+          uint32_t count = tu_u32(p[8], p[9], p[10], p[11]);
+
+          if (p[0] | p[1] | p[2] | p[3] || lba > nblocks || count > nblocks - lba)
+          {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+            resplen = -1;
+            break;
+          }
+          msc_disk_unmap(lba, count);
+        }
+      }
+    break;
+
+    case SCSI_CMD_SERVICE_ACTION_IN_16:
+      if ((scsi_cmd[1] & 0x1f) == SCSI_SA_READ_CAPACITY_16)
+      {
+        // Last LBA & block size, with 8 logical blocks per physical sector,
+        // and logical block provisioning (UNMAP) enabled. TinyUSB answers
+        // INQUIRY itself, without the provisioning VPD pages, so only hosts
+        // that send UNMAP without checking those pages will use it
+        uint8_t cap[32] = {0};
+        uint32_t last = msc_disk_size() / MSC_BLOCK_SIZE - 1;
+        uint32_t alloc = tu_u32(scsi_cmd[10], scsi_cmd[11], scsi_cmd[12], scsi_cmd[13]);
+
+        cap[4] = last >> 24; cap[5] = last >> 16; cap[6] = last >> 8; cap[7] = last;
+        cap[10] = MSC_BLOCK_SIZE >> 8; cap[11] = MSC_BLOCK_SIZE & 0xff;
+        cap[13] = 3;
+        cap[14] = 0x80;
+        resplen = tu_min32(sizeof(cap), tu_min32(alloc, bufsize));
+        memcpy(buffer, cap, resplen);
+        break;
+      }
+      tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+      resplen = -1;
+    break;
+
     default:
       // Set Sense = Invalid Command Operation
       tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
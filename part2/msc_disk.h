@@ -0,0 +1,53 @@
+// USB Mass Storage disk on ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __MSC_DISK_H__
+#define __MSC_DISK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MSC_BLOCK_SIZE      512     // Logical block size seen by host
+#define MSC_SECTOR_SIZE     4096    // Flash erase sector size
+#define MSC_SECTOR_BLOCKS   (MSC_SECTOR_SIZE / MSC_BLOCK_SIZE)
+#define MSC_CACHE_MAX       8       // Max number of sectors in RAM cache
+#define MSC_CACHE_SIZE      8       // Default number of cached sectors
+#define MSC_READ_AHEAD      2       // Sectors to read ahead on sequential miss
+#define MSC_FLUSH_MSEC      500     // Idle time before writing back dirty sectors
+#define MSC_STATS_MSEC      5000    // Interval for statistics display
+#define MSC_MAX_SECTORS     1024    // Max disk size in sectors, for free-sector tracking
+
+// MSC cache & throughput statistics
+typedef struct {
+    uint32_t hits, misses, read_ahead;
+    uint32_t rd_bytes, rd_usec;
+    uint32_t wr_bytes, wr_usec;
+    uint32_t unmapped, bg_erases, pre_erased, flush_steps;
+} msc_stats_t;
+
+bool msc_disk_init(void);
+bool msc_disk_format(void);
+uint32_t msc_disk_size(void);
+bool msc_disk_read(uint32_t addr, void *buff, uint32_t len);
+bool msc_disk_write(uint32_t addr, const void *buff, uint32_t len);
+void msc_disk_unmap(uint32_t block, uint32_t count);
+void msc_cache_init(int nsectors);
+bool msc_flush(void);
+void msc_stats_print(void);
+void msc_task(void);
+
+#endif
+// EOF
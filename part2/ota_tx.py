@@ -0,0 +1,54 @@
+# Send an image file to the Pico OTA server, to be written to WINC flash
+# Usage: python ota_tx.py FILE [FLASH_ADDR]
+# The address must be within the OTA region (default: start of region)
+import socket, struct, sys, time, zlib
+
+ADDR = "10.1.1.11"
+PORT = 1026
+MAGIC = 0x3141544f
+OTA_BASE = 0x80000
+RETRIES = 5
+STATUS = ["OK", "Invalid header", "Flash error", "CRC error"]
+
+fname = sys.argv[1]
+flash_addr = int(sys.argv[2], 0) if len(sys.argv) > 2 else OTA_BASE
+data = open(fname, "rb").read()
+crc = zlib.crc32(data) & 0xffffffff
+hdr = struct.pack("<4I", MAGIC, flash_addr, len(data), crc)
+
+def recv_u32(sock):
+    d = b""
+    while len(d) < 4:
+        r = sock.recv(4 - len(d))
+        if not r:
+            raise IOError("Connection closed")
+        d += r
+    return struct.unpack("<I", d)[0]
+
+print("Send %s (%u bytes, CRC %08x) to %s:%s flash %x" %
+      (fname, len(data), crc, ADDR, PORT, flash_addr))
+start = time.time()
+for attempt in range(RETRIES):
+    try:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.settimeout(10)
+        sock.connect((ADDR, PORT))
+        sock.sendall(hdr)
+        oset = recv_u32(sock)
+        if oset:
+            print("Resuming at %u" % oset)
+        sock.sendall(data[oset:])
+        status = recv_u32(sock)
+        sock.close()
+        break
+    except (IOError, socket.error) as e:
+        print("Error: %s, retrying" % e)
+        sock.close()
+        time.sleep(1)
+else:
+    sys.exit("Failed")
+dt = time.time() - start
+print("Status: %s" % (STATUS[status] if status < len(STATUS) else status))
+print("%u bytes in %.2f s, %.1f KB/s, %.2f s/MB" %
+      (len(data), dt, len(data)/1024.0/dt, dt * 1024 * 1024 / len(data)))
+# EOF
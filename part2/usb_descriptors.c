@@ -80,6 +80,7 @@ enum {
   ITF_NUM_CDC = 0,
   ITF_NUM_CDC_DATA,
   ITF_NUM_MSC,
+  ITF_NUM_VENDOR,
   ITF_NUM_TOTAL
 };
 
@@ -93,6 +94,9 @@ enum {
   #define EPNUM_MSC_OUT     0x05
   #define EPNUM_MSC_IN      0x85
 
+  #define EPNUM_VENDOR_OUT  0x08
+  #define EPNUM_VENDOR_IN   0x88
+
 #elif CFG_TUSB_MCU == OPT_MCU_CXD56
   // CXD56 USB driver has fixed endpoint type (bulk/interrupt/iso) and direction (IN/OUT) by its number
   // 0 control (IN/OUT), 1 Bulk (IN), 2 Bulk (OUT), 3 In (IN), 4 Bulk (IN), 5 Bulk (OUT), 6 In (IN)
@@ -103,6 +107,10 @@ enum {
   #define EPNUM_MSC_OUT     0x05
   #define EPNUM_MSC_IN      0x84
 
+  #if CFG_TUD_VENDOR
+  #error "No bulk endpoints left for vendor interface"
+  #endif
+
 #elif defined(TUD_ENDPOINT_ONE_DIRECTION_ONLY)
   // MCUs that don't support a same endpoint number with different direction IN and OUT defined in tusb_mcu.h
   //    e.g EP1 OUT & EP1 IN cannot exist together
@@ -113,6 +121,9 @@ enum {
   #define EPNUM_MSC_OUT     0x04
   #define EPNUM_MSC_IN      0x85
 
+  #define EPNUM_VENDOR_OUT  0x06
+  #define EPNUM_VENDOR_IN   0x87
+
 #else
   #define EPNUM_CDC_NOTIF   0x81
   #define EPNUM_CDC_OUT     0x02
@@ -121,9 +132,12 @@ enum {
   #define EPNUM_MSC_OUT     0x03
   #define EPNUM_MSC_IN      0x83
 
+  #define EPNUM_VENDOR_OUT  0x04
+  #define EPNUM_VENDOR_IN   0x84
+
 #endif
 
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_MSC_DESC_LEN)
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_MSC_DESC_LEN + TUD_VENDOR_DESC_LEN)
 
 // full speed configuration
 uint8_t const desc_fs_configuration[] = {
@@ -135,6 +149,9 @@ uint8_t const desc_fs_configuration[] = {
 
     // Interface number, string index, EP Out & EP In address, EP size
     TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 5, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
+
+    // Interface number, string index, EP Out & EP In address, EP size
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 6, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, 64),
 };
 
 #if TUD_OPT_HIGH_SPEED
@@ -150,6 +167,9 @@ uint8_t const desc_hs_configuration[] = {
 
     // Interface number, string index, EP Out & EP In address, EP size
     TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 5, EPNUM_MSC_OUT, EPNUM_MSC_IN, 512),
+
+    // Interface number, string index, EP Out & EP In address, EP size
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 6, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, 512),
 };
 
 // other speed configuration
@@ -232,6 +252,7 @@ char const *string_desc_arr[] = {
     NULL,                          // 3: Serials will use unique ID if possible
     "TinyUSB CDC",                 // 4: CDC Interface
     "TinyUSB MSC",                 // 5: MSC Interface
+    "WINC Flash",                  // 6: Vendor Interface
 };
 
 static uint16_t _desc_str[32 + 1];
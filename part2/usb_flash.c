@@ -0,0 +1,256 @@
+// USB vendor-class interface for raw ATWINC1500/1510 flash access, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Bulk transfers are serviced from the main loop, a buffer at a time,
+// so the flash is read while USB drains the previous buffer from the
+// endpoint FIFO. Access to the flash bypasses the MSC disk, so its
+// cache is flushed & discarded before and after a write or erase. The
+// same applies to the key-value store & event log at the top of flash;
+// if a write or erase reaches them, they are reloaded afterwards
+
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "winc_wifi.h"
+#include "winc_flash.h"
+#include "winc_ota.h"
+#include "winc_kv.h"
+#include "winc_log.h"
+#include "msc_disk.h"
+#include "usb_flash.h"
+
+#if CFG_TUD_VENDOR
+
+enum { STATE_IDLE, STATE_READ, STATE_WRITE };
+
+static int state;
+static usb_flash_cmd_t cmd;
+static uint32_t hdr_len, done, buff_len, buff_oset, start;
+static uint8_t buff[USB_FLASH_BUFF_SIZE];
+static bool top_changed;
+
+// Send reply to host, and return to idle state
+static void usb_flash_reply(uint32_t status, uint32_t value)
+{
+  usb_flash_reply_t reply = {status, value};
+  uint32_t dt = usec() - start;
+
+  tud_vendor_write(&reply, sizeof(reply));
+  tud_vendor_write_flush();
+  printf("USB flash cmd %lu addr %lx len %lu: status %lu, %lu ms (%lu KB/s)\n",
+         cmd.cmd, cmd.addr, cmd.len, status, dt / 1000,
+         dt ? (uint32_t)(cmd.len * 1000ULL / dt) : 0);
+  state = STATE_IDLE;
+  hdr_len = 0;
+}
+
+// Handler for streamed flash read, to update CRC
+static bool usb_flash_crc_handler(void *ctx, uint32_t addr, uint8_t *data, uint32_t len)
+{
+  uint32_t *crcp = ctx;
+
+  (void) addr;
+  *crcp = crc32(*crcp, data, len);
+  return true;
+}
+
+// Write buffer to flash: either erase & program, or only rewrite changes
+static bool usb_flash_program(uint32_t addr, uint32_t len)
+{
+  if (cmd.arg & USB_FLASH_WRITE_DELTA)
+    return spi_flash_update(g_spi_fd, buff, addr, len, NULL) == M2M_SUCCESS;
+  return spi_flash_erase(g_spi_fd, addr, len) == M2M_SUCCESS &&
+         spi_flash_write(g_spi_fd, buff, addr, len) == M2M_SUCCESS;
+}
+
+// Prepare for flash write or erase, flushing data held in RAM
+static void usb_flash_change_start(uint32_t size)
+{
+  msc_cache_init(MSC_CACHE_SIZE);
+  top_changed = size >= FLASH_USER_MIN && cmd.addr + cmd.len > size - KV_SIZE - LOG_SIZE;
+  if (top_changed)
+  {
+    kv_flush();
+    log_flush();
+  }
+}
+
+// Flash has been written or erased: discard or reload data held in RAM
+static void usb_flash_change_end(void)
+{
+  msc_cache_init(MSC_CACHE_SIZE);
+  if (top_changed)
+  {
+    kv_init(g_spi_fd);
+    log_init(g_spi_fd);
+    top_changed = false;
+  }
+}
+
+// Start a new command, given the header
+static void usb_flash_start(void)
+{
+  uint32_t size = spi_flash_get_size(g_spi_fd) * 1024 * 1024 / 8, crc = 0;
+  bool ok;
+
+  start = usec();
+  done = buff_len = buff_oset = 0;
+  if (cmd.cmd == USB_FLASH_INFO)
+  {
+    usb_flash_reply(USB_FLASH_OK, size);
+    return;
+  }
+  if (cmd.cmd == USB_FLASH_LOG)
+  {
+    log_flush();
+    if (cmd.len == 0 || cmd.addr >= LOG_SIZE || cmd.len > LOG_SIZE - cmd.addr)
+    {
+      usb_flash_reply(cmd.len ? USB_FLASH_ERR_CMD : USB_FLASH_OK, LOG_SIZE);
+      return;
+    }
+    cmd.addr += log_base;
+  }
+  if (cmd.cmd == USB_FLASH_FORMAT)
+  {
+    ok = msc_disk_format();
+    usb_flash_reply(ok ? USB_FLASH_OK : USB_FLASH_ERR_FLASH, msc_disk_size());
+    return;
+  }
+  if (cmd.addr >= size || cmd.len > size - cmd.addr ||
+      (cmd.cmd == USB_FLASH_WRITE && cmd.addr % FLASH_SECTOR_SZ) ||
+      (cmd.cmd == USB_FLASH_ERASE && (cmd.addr | cmd.len) % FLASH_SECTOR_SZ))
+  {
+    usb_flash_reply(USB_FLASH_ERR_CMD, 0);
+    return;
+  }
+  switch (cmd.cmd)
+  {
+    case USB_FLASH_READ:
+    case USB_FLASH_LOG:
+      state = STATE_READ;
+    break;
+
+    case USB_FLASH_WRITE:
+      usb_flash_change_start(size);
+      state = STATE_WRITE;
+    break;
+
+    case USB_FLASH_ERASE:
+      usb_flash_change_start(size);
+      ok = spi_flash_erase(g_spi_fd, cmd.addr, cmd.len) == M2M_SUCCESS;
+      usb_flash_change_end();
+      usb_flash_reply(ok ? USB_FLASH_OK : USB_FLASH_ERR_FLASH, usec() - start);
+    break;
+
+    case USB_FLASH_VERIFY:
+      ok = cmd.len == 0 || spi_flash_read_stream(g_spi_fd, cmd.addr, cmd.len, buff,
+              USB_FLASH_BUFF_SIZE, usb_flash_crc_handler, &crc) == M2M_SUCCESS;
+      usb_flash_reply(!ok ? USB_FLASH_ERR_FLASH : crc != cmd.arg ? USB_FLASH_ERR_CRC :
+                      USB_FLASH_OK, crc);
+    break;
+
+    default:
+      usb_flash_reply(USB_FLASH_ERR_CMD, 0);
+    break;
+  }
+}
+
+// Send flash data to host, reading the next buffer when the last is sent
+static void usb_flash_read_task(void)
+{
+  uint32_t n;
+
+  if (buff_oset == buff_len)
+  {
+    if (done == cmd.len)
+    {
+      usb_flash_reply(USB_FLASH_OK, usec() - start);
+      return;
+    }
+    buff_len = MIN(cmd.len - done, USB_FLASH_BUFF_SIZE);
+    buff_oset = 0;
+    if (spi_flash_read(g_spi_fd, buff, cmd.addr + done, buff_len) != M2M_SUCCESS)
+    {
+      usb_flash_reply(USB_FLASH_ERR_FLASH, 0);
+      return;
+    }
+    done += buff_len;
+  }
+  n = MIN(tud_vendor_write_available(), buff_len - buff_oset);
+  if (n > 0)
+  {
+    buff_oset += tud_vendor_write(&buff[buff_oset], n);
+    tud_vendor_write_flush();
+  }
+}
+
+// Get data from host, and write it to flash a sector at a time
+static void usb_flash_write_task(void)
+{
+  uint32_t n = MIN(tud_vendor_available(), MIN(cmd.len - done, USB_FLASH_BUFF_SIZE) - buff_len);
+
+  if (n > 0)
+    buff_len += tud_vendor_read(&buff[buff_len], n);
+  if (buff_len > 0 && (buff_len == USB_FLASH_BUFF_SIZE || done + buff_len == cmd.len))
+  {
+    if (!usb_flash_program(cmd.addr + done, buff_len))
+    {
+      usb_flash_change_end();
+      usb_flash_reply(USB_FLASH_ERR_FLASH, 0);
+      return;
+    }
+    done += buff_len;
+    buff_len = 0;
+  }
+  if (done == cmd.len)
+  {
+    usb_flash_change_end();
+    usb_flash_reply(USB_FLASH_OK, usec() - start);
+  }
+}
+
+// Service vendor interface; call regularly from main loop
+void usb_flash_task(void)
+{
+  if (!tud_vendor_mounted())
+  {
+    state = STATE_IDLE;
+    hdr_len = 0;
+    return;
+  }
+  switch (state)
+  {
+    case STATE_IDLE:
+      if (tud_vendor_available())
+      {
+        hdr_len += tud_vendor_read((uint8_t *)&cmd + hdr_len, sizeof(cmd) - hdr_len);
+        if (hdr_len == sizeof(cmd))
+          usb_flash_start();
+      }
+    break;
+
+    case STATE_READ:
+      usb_flash_read_task();
+    break;
+
+    case STATE_WRITE:
+      usb_flash_write_task();
+    break;
+  }
+}
+
+#endif
+// EOF
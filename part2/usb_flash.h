@@ -0,0 +1,57 @@
+// USB vendor-class interface for raw ATWINC1500/1510 flash access, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __USB_FLASH_H__
+#define __USB_FLASH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Commands; each starts with a 16-byte header from the host, and ends
+// with an 8-byte reply (status & value) from the device
+#define USB_FLASH_INFO      0       // Reply value: flash size in bytes
+#define USB_FLASH_READ      1       // Device sends data, then reply
+#define USB_FLASH_WRITE     2       // Host sends data, then device replies
+#define USB_FLASH_ERASE     3       // Address & length must be sector-aligned
+#define USB_FLASH_VERIFY    4       // Reply value: CRC-32 of area
+#define USB_FLASH_LOG       5       // Read event log area at offset; if len 0,
+                                    // reply value is log area size
+#define USB_FLASH_FORMAT    6       // Format MSC disk, discarding its data
+
+#define USB_FLASH_WRITE_DELTA 1     // Write option: only rewrite changed sectors
+
+// Status values
+#define USB_FLASH_OK        0
+#define USB_FLASH_ERR_CMD   1       // Unknown command or invalid address
+#define USB_FLASH_ERR_FLASH 2       // Flash access failed
+#define USB_FLASH_ERR_CRC   3       // CRC didn't match expected value
+
+#define USB_FLASH_BUFF_SIZE 4096    // Flash data buffer size
+
+// Command header, little-endian
+typedef struct {
+    uint32_t cmd, addr, len, arg;
+} usb_flash_cmd_t;
+
+// Reply; value is command-specific, or time taken in usec
+typedef struct {
+    uint32_t status, value;
+} usb_flash_reply_t;
+
+void usb_flash_task(void);
+
+#endif
+// EOF
@@ -0,0 +1,140 @@
+# Read, write, erase & verify WINC flash over the Pico USB vendor interface
+# Requires pyusb; e.g.
+#   python usb_flash.py info
+#   python usb_flash.py read FILE [ADDR [LEN]]
+#   python usb_flash.py write FILE [ADDR] [--delta]
+#   python usb_flash.py erase ADDR LEN
+#   python usb_flash.py verify FILE [ADDR]
+#   python usb_flash.py log [FILE]
+#   python usb_flash.py format
+import struct, sys, time, zlib
+import usb.core, usb.util
+
+VID = 0xcafe
+CMD_INFO, CMD_READ, CMD_WRITE, CMD_ERASE, CMD_VERIFY, CMD_LOG, CMD_FORMAT = range(7)
+SECTOR_SZ = 4096
+WRITE_DELTA = 1
+STATUS = ["OK", "Invalid command", "Flash error", "CRC error"]
+TIMEOUT = 60000
+CHUNK = 16384
+
+def find_vendor_intf():
+    for dev in usb.core.find(find_all=True, idVendor=VID):
+        for cfg in dev:
+            for intf in cfg:
+                if intf.bInterfaceClass == 0xff:
+                    return dev, intf
+    sys.exit("Device not found")
+
+dev, intf = find_vendor_intf()
+ep_out = usb.util.find_descriptor(intf, custom_match=lambda e:
+    usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+ep_in = usb.util.find_descriptor(intf, custom_match=lambda e:
+    usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+
+def command(cmd, addr=0, length=0, arg=0):
+    ep_out.write(struct.pack("<4I", cmd, addr, length, arg), TIMEOUT)
+
+def reply():
+    status, value = struct.unpack("<2I", bytes(ep_in.read(8, TIMEOUT)))
+    if status:
+        sys.exit("Error: %s" % (STATUS[status] if status < len(STATUS) else status))
+    return value
+
+def report(op, nbytes, dt):
+    print("%s %u bytes in %.2f s (%.1f KB/s)" % (op, nbytes, dt, nbytes/1024.0/dt if dt else 0))
+
+def flash_size():
+    command(CMD_INFO)
+    return reply()
+
+# Event log: pages of 256 bytes, each with header (seq, len, check),
+# then records with header (msec, id, len) and data. The newest page
+# may be incomplete, with erased len & check; its records end at the
+# first erased record header
+PAGE_SZ, NO_SEQ, NO_LEN = 256, 0xffffffff, 0xffff
+LOG_EVENTS = {1:"Boot", 2:"Text", 3:"WiFi state", 4:"DHCP", 5:"OTA"}
+
+def log_event_str(ident, data):
+    if ident == 2:
+        return data.decode("ascii", "replace")
+    if ident == 4 and len(data) == 4:
+        return "%u.%u.%u.%u" % tuple(data)
+    if len(data) % 4 == 0 and data:
+        return " ".join("0x%x" % v for v in struct.unpack("<%uI" % (len(data)//4), data))
+    return data.hex()
+
+def log_decode(data):
+    pages = []
+    for oset in range(0, len(data), PAGE_SZ):
+        seq, dlen, check = struct.unpack_from("<IHH", data, oset)
+        if seq != NO_SEQ and dlen == NO_LEN and check == NO_LEN:
+            pages.append((seq, data[oset+8 : oset+PAGE_SZ]))
+        elif seq != NO_SEQ and dlen <= PAGE_SZ-8 and zlib.crc32(data[oset+8 : oset+8+dlen]) & 0xffff == check:
+            pages.append((seq, data[oset+8 : oset+8+dlen]))
+    for seq, body in sorted(pages):
+        i = 0
+        while i + 8 <= len(body):
+            msec, ident, dlen = struct.unpack_from("<IHH", body, i)
+            if ident == NO_LEN:
+                break
+            print("%6u %10.3f %-10s %s" % (seq, msec/1000.0, LOG_EVENTS.get(ident, ident),
+                  log_event_str(ident, body[i+8 : i+8+dlen])))
+            i += 8 + dlen
+
+args = [a for a in sys.argv[1:] if not a.startswith("--")]
+op = args[0] if args else "info"
+start = time.time()
+if op == "info":
+    print("Flash size %u bytes" % flash_size())
+elif op == "read":
+    addr = int(args[2], 0) if len(args) > 2 else 0
+    length = int(args[3], 0) if len(args) > 3 else flash_size() - addr
+    command(CMD_READ, addr, length)
+    data = bytearray()
+    while len(data) < length:
+        data += ep_in.read(min(CHUNK, length - len(data)), TIMEOUT)
+    reply()
+    open(args[1], "wb").write(data)
+    report("Read", length, time.time() - start)
+elif op == "write":
+    data = open(args[1], "rb").read()
+    addr = int(args[2], 0) if len(args) > 2 else 0
+    command(CMD_WRITE, addr, len(data), WRITE_DELTA if "--delta" in sys.argv else 0)
+    for i in range(0, len(data), CHUNK):
+        ep_out.write(data[i:i+CHUNK], TIMEOUT)
+    reply()
+    report("Write", len(data), time.time() - start)
+    command(CMD_VERIFY, addr, len(data), zlib.crc32(data) & 0xffffffff)
+    reply()
+    print("Verify OK")
+elif op == "erase":
+    addr, length = int(args[1], 0), int(args[2], 0)
+    if (addr | length) % SECTOR_SZ:
+        sys.exit("Erase address & length must be multiples of %u" % SECTOR_SZ)
+    command(CMD_ERASE, addr, length)
+    reply()
+    report("Erase", length, time.time() - start)
+elif op == "verify":
+    data = open(args[1], "rb").read()
+    addr = int(args[2], 0) if len(args) > 2 else 0
+    command(CMD_VERIFY, addr, len(data), zlib.crc32(data) & 0xffffffff)
+    reply()
+    report("Verify OK:", len(data), time.time() - start)
+elif op == "log":
+    command(CMD_LOG)
+    length = reply()
+    command(CMD_LOG, 0, length)
+    data = bytearray()
+    while len(data) < length:
+        data += ep_in.read(min(CHUNK, length - len(data)), TIMEOUT)
+    reply()
+    if len(args) > 1:
+        open(args[1], "wb").write(data)
+    log_decode(bytes(data))
+elif op == "format":
+    command(CMD_FORMAT)
+    print("Formatted, disk size %u bytes" % reply())
+else:
+    sys.exit("Unknown operation '%s'" % op)
+# EOF
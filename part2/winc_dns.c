@@ -0,0 +1,145 @@
+// ATWINC1500/1510 WiFi module DNS functions for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The WINC resolver doesn't report the record TTL, so cache entries
+// expire after a fixed lifetime, set by dns_cache_init
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_dns.h"
+
+DNS_ENTRY dns_cache[DNS_CACHE_MAX];
+DNS_STATS dns_stats;
+int dns_cache_size=DNS_CACHE_SIZE;
+uint32_t dns_cache_ttl=DNS_CACHE_TTL;
+extern int verbose;
+
+// Set number of cache entries, and lifetime in msec; clear cache
+void dns_cache_init(int size, uint32_t ttl)
+{
+    dns_cache_size = MAX(1, MIN(size, DNS_CACHE_MAX));
+    dns_cache_ttl = MIN(ttl, 3600000);
+    memset(dns_cache, 0, sizeof(dns_cache));
+    memset(&dns_stats, 0, sizeof(dns_stats));
+}
+
+// Find cache entry for name, null if not found
+DNS_ENTRY *dns_cache_find(char *name)
+{
+    DNS_ENTRY *dp;
+    int i;
+
+    for (i=0, dp=dns_cache; i<dns_cache_size; i++, dp++)
+    {
+        if ((dp->ip || dp->pending) && !strcmp(dp->name, name))
+            return(dp);
+    }
+    return(0);
+}
+
+// Get a free cache entry, or the least-recently used entry
+DNS_ENTRY *dns_cache_alloc(void)
+{
+    DNS_ENTRY *dp, *oldest=0;
+    uint32_t t=usec();
+    int i;
+
+    for (i=0, dp=dns_cache; i<dns_cache_size; i++, dp++)
+    {
+        if (!dp->ip && !dp->pending)
+            return(dp);
+        if (!dp->pending && (!oldest || t-dp->used > t-oldest->used))
+            oldest = dp;
+    }
+    return(oldest);
+}
+
+// Resolve hostname; if cached, call handler immediately, otherwise
+// send request to module, and call handler when response arrives
+bool dns_resolve(int fd, char *name, DNS_HANDLER handler)
+{
+    DNS_ENTRY *dp;
+    int len=strlen(name);
+
+    if (len >= DNS_NAME_LEN)
+        return(0);
+    if ((dp = dns_cache_find(name)) != 0)
+    {
+        if (dp->pending)
+        {
+            dp->handler = handler;
+            return(1);
+        }
+        if (usec() - dp->time < dns_cache_ttl*1000)
+        {
+            dns_stats.hits++;
+            dp->used = usec();
+            if (handler)
+                handler(fd, name, dp->ip);
+            return(1);
+        }
+    }
+    else if ((dp = dns_cache_alloc()) == 0)
+        return(0);
+    dns_stats.misses++;
+    memset(dp, 0, sizeof(DNS_ENTRY));
+    strcpy(dp->name, name);
+    dp->pending = 1;
+    dp->handler = handler;
+    if (!hif_put(fd, GOP_DNS_RESOLVE, name, len+1, 0, 0, 0))
+    {
+        dp->pending = 0;
+        return(0);
+    }
+    return(1);
+}
+
+// Handle DNS response from module
+void dns_reply(int fd, DNS_RESP_MSG *dmp)
+{
+    DNS_ENTRY *dp;
+    DNS_HANDLER handler;
+
+    dmp->name[DNS_NAME_LEN-1] = 0;
+    if (verbose)
+        printf("DNS %s %u.%u.%u.%u\n", dmp->name, IP_BYTES(dmp->ip));
+    if ((dp = dns_cache_find(dmp->name)) != 0 && dp->pending)
+    {
+        handler = dp->handler;
+        dp->pending = 0;
+        dp->ip = dmp->ip;
+        dp->time = dp->used = usec();
+        if (!dmp->ip)
+            dns_stats.fails++;
+        if (handler)
+            handler(fd, dmp->name, dmp->ip);
+    }
+}
+
+// Display cache statistics
+void dns_cache_stats(void)
+{
+    uint32_t total = dns_stats.hits + dns_stats.misses;
+
+    printf("DNS cache hits %lu misses %lu fails %lu (%lu%% hit)\n",
+           dns_stats.hits, dns_stats.misses, dns_stats.fails,
+           total ? dns_stats.hits*100/total : 0);
+}
+
+// EOF
@@ -0,0 +1,55 @@
+#ifndef __WINC_DNS_H__
+#define __WINC_DNS_H__
+
+// ATWINC1500/1510 WiFi DNS definitions for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define DNS_NAME_LEN        64      // Max hostname length, including null
+#define DNS_CACHE_MAX       16      // Max number of cache entries
+#define DNS_CACHE_SIZE      8       // Default number of cache entries
+#define DNS_CACHE_TTL       300000  // Default cache lifetime (msec, max 1 hour)
+
+// DNS response message
+typedef struct {
+    char name[DNS_NAME_LEN];
+    uint32_t ip;
+} DNS_RESP_MSG;
+
+// Handler for DNS result, IP address in network order (0 if failed)
+typedef void (* DNS_HANDLER)(int fd, char *name, uint32_t ip);
+
+// DNS cache entry
+typedef struct {
+    char name[DNS_NAME_LEN];
+    uint32_t ip, time, used;
+    bool pending;
+    DNS_HANDLER handler;
+} DNS_ENTRY;
+
+// DNS cache statistics
+typedef struct {
+    uint32_t hits, misses, fails;
+} DNS_STATS;
+
+extern DNS_STATS dns_stats;
+
+void dns_cache_init(int size, uint32_t ttl);
+bool dns_resolve(int fd, char *name, DNS_HANDLER handler);
+void dns_reply(int fd, DNS_RESP_MSG *dmp);
+void dns_cache_stats(void);
+
+#endif
+// EOF
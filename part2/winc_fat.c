@@ -0,0 +1,255 @@
+// Read-only FAT12/16 filesystem on the MSC disk, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// All reads go through the MSC disk cache, so they see the latest data
+// written by the USB host. The boot sector is re-read when a file is
+// opened, in case the host has reformatted the disk. Long filenames are
+// matched as well as 8.3 names, ignoring case; non-ASCII characters in
+// long names are never matched.
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_flash.h"
+#include "winc_fat.h"
+#include "msc_disk.h"
+
+FAT_VOL fat_vol;
+
+// Return little-endian 16 & 32-bit values from byte array
+static uint16_t rd16(uint8_t *p)
+{
+    return(p[0] | (p[1] << 8));
+}
+static uint32_t rd32(uint8_t *p)
+{
+    return(rd16(p) | ((uint32_t)rd16(p+2) << 16));
+}
+
+// Get layout of volume from boot sector; skip partition table if present
+bool fat_mount(void)
+{
+    uint8_t bs[64], sig[2], lba[4];
+    uint32_t base=0, sect_size, nsects, fat_sects, nroot;
+    int i;
+
+    for (i=0; i<2; i++)
+    {
+        if (!msc_disk_read(base, bs, sizeof(bs)) || !msc_disk_read(base+510, sig, 2) ||
+            sig[0]!=0x55 || sig[1]!=0xaa)
+            return(false);
+        sect_size = rd16(&bs[11]);
+        if (bs[13] && (sect_size==512 || sect_size==1024 || sect_size==2048 || sect_size==4096))
+            break;
+        // No BPB: use first partition of MBR
+        if (i>0 || !msc_disk_read(0x1c6, lba, sizeof(lba)))
+            return(false);
+        base = rd32(lba) * MSC_BLOCK_SIZE;
+    }
+    fat_sects = rd16(&bs[22]);
+    nsects = rd16(&bs[19]) ? rd16(&bs[19]) : rd32(&bs[32]);
+    nroot = rd16(&bs[17]);
+    if (fat_sects==0 || bs[16]==0 || nroot==0)
+        return(false);
+    fat_vol.fat_addr = base + rd16(&bs[14]) * sect_size;
+    fat_vol.root_addr = fat_vol.fat_addr + bs[16] * fat_sects * sect_size;
+    fat_vol.root_entries = nroot;
+    fat_vol.data_addr = fat_vol.root_addr + nroot * FAT_DIR_SIZE;
+    fat_vol.data_addr = base + (fat_vol.data_addr - base + sect_size - 1) / sect_size * sect_size;
+    fat_vol.clust_size = bs[13] * sect_size;
+    fat_vol.nclusts = (base + nsects*sect_size - fat_vol.data_addr) / fat_vol.clust_size;
+    fat_vol.fat_bits = fat_vol.nclusts < 4085 ? 12 : 16;
+    return(true);
+}
+
+// Return next cluster in chain, 0 if end or error
+static uint32_t fat_next(uint32_t clust)
+{
+    uint8_t b[2];
+    uint32_t val;
+
+    if (clust<2 || clust>=fat_vol.nclusts+2)
+        return(0);
+    if (fat_vol.fat_bits == 12)
+    {
+        if (!msc_disk_read(fat_vol.fat_addr + clust + clust/2, b, 2))
+            return(0);
+        val = clust & 1 ? rd16(b) >> 4 : rd16(b) & 0xfff;
+        return(val>=2 && val<0xff7 ? val : 0);
+    }
+    if (!msc_disk_read(fat_vol.fat_addr + clust*2, b, 2))
+        return(0);
+    val = rd16(b);
+    return(val>=2 && val<0xfff7 ? val : 0);
+}
+
+// Return disk address of cluster
+static uint32_t clust_addr(uint32_t clust)
+{
+    return(fat_vol.data_addr + (clust-2) * fat_vol.clust_size);
+}
+
+// Copy 8.3 name from directory entry into string, as NAME.EXT
+static void short_name(uint8_t *de, char *s)
+{
+    int i, n=0;
+
+    for (i=0; i<8 && de[i]!=' '; i++)
+        s[n++] = de[i];
+    if (de[8] != ' ')
+    {
+        s[n++] = '.';
+        for (i=8; i<11 && de[i]!=' '; i++)
+            s[n++] = de[i];
+    }
+    s[n] = 0;
+}
+
+// Add the characters from a long filename entry to a name string
+static void long_name(uint8_t *de, char *s)
+{
+    static const uint8_t osets[13] = {1,3,5,7,9,14,16,18,20,22,24,28,30};
+    int i, idx=((de[0] & 0x1f) - 1) * 13;
+    uint16_t c;
+
+    for (i=0; i<13 && idx+i<FAT_NAME_MAX-1; i++)
+    {
+        c = rd16(&de[osets[i]]);
+        if (c == 0)
+        {
+            s[idx+i] = 0;
+            break;
+        }
+        s[idx+i] = c < 0x80 ? c : 0x7f;
+    }
+    if (de[0] & 0x40)
+        s[MIN(idx+i, FAT_NAME_MAX-1)] = 0;
+}
+
+// Find name in directory (cluster 0 for root), return file
+static bool fat_find(uint32_t dclust, char *name, FAT_FILE *fp)
+{
+    uint8_t de[FAT_DIR_SIZE];
+    char lname[FAT_NAME_MAX]="", sname[13];
+    uint32_t addr, n, per_clust=fat_vol.clust_size/FAT_DIR_SIZE;
+    bool root = dclust==0;
+
+    for (n=0; root ? n<fat_vol.root_entries : dclust!=0; n++)
+    {
+        if (!root && n == per_clust)
+        {
+            dclust = fat_next(dclust);
+            n = 0;
+            if (dclust == 0)
+                break;
+        }
+        addr = root ? fat_vol.root_addr + n*FAT_DIR_SIZE : clust_addr(dclust) + n*FAT_DIR_SIZE;
+        if (!msc_disk_read(addr, de, sizeof(de)) || de[0]==0)
+            break;
+        if (de[0] == 0xe5)
+            lname[0] = 0;
+        else if (de[11] == FAT_ATTR_LFN)
+            long_name(de, lname);
+        else
+        {
+            short_name(de, sname);
+            if (!(de[11] & FAT_ATTR_VOL) &&
+                (!strcasecmp(name, sname) || (lname[0] && !strcasecmp(name, lname))))
+            {
+                fp->start = rd16(&de[26]);
+                fp->size = rd32(&de[28]);
+                fp->dir = (de[11] & FAT_ATTR_DIR) != 0;
+                fp->clust = fp->start;
+                fp->clust_pos = 0;
+                return(true);
+            }
+            lname[0] = 0;
+        }
+    }
+    return(false);
+}
+
+// Open file or directory, given path from root
+bool fat_open(char *path, FAT_FILE *fp)
+{
+    char name[FAT_NAME_MAX];
+    uint32_t dclust=0;
+    int n;
+
+    if (!fat_mount())
+        return(false);
+    memset(fp, 0, sizeof(FAT_FILE));
+    fp->dir = true;
+    while (*path)
+    {
+        while (*path == '/')
+            path++;
+        for (n=0; *path && *path!='/'; path++)
+        {
+            if (n >= FAT_NAME_MAX-1)
+                return(false);
+            name[n++] = *path;
+        }
+        name[n] = 0;
+        if (n == 0)
+            break;
+        if (!fp->dir || !fat_find(dclust, name, fp))
+            return(false);
+        dclust = fp->start;
+    }
+    return(true);
+}
+
+// Read file data at given position, return byte count, -1 if error
+int fat_read(FAT_FILE *fp, uint32_t pos, void *buff, int len)
+{
+    uint8_t *dp = buff;
+    uint32_t n, oset;
+    int count=0;
+
+    if (pos >= fp->size)
+        return(0);
+    len = MIN((uint32_t)len, fp->size - pos);
+    if (pos < fp->clust_pos)
+    {
+        fp->clust = fp->start;
+        fp->clust_pos = 0;
+    }
+    while (len > 0)
+    {
+        while (pos >= fp->clust_pos + fat_vol.clust_size)
+        {
+            if ((fp->clust = fat_next(fp->clust)) == 0)
+                return(-1);
+            fp->clust_pos += fat_vol.clust_size;
+        }
+        if (fp->clust < 2)
+            return(-1);
+        oset = pos - fp->clust_pos;
+        n = MIN((uint32_t)len, fat_vol.clust_size - oset);
+        if (!msc_disk_read(clust_addr(fp->clust) + oset, dp, n))
+            return(-1);
+        dp += n;
+        pos += n;
+        len -= n;
+        count += n;
+    }
+    return(count);
+}
+
+// EOF
@@ -0,0 +1,47 @@
+#ifndef __WINC_FAT_H__
+#define __WINC_FAT_H__
+
+// Read-only FAT12/16 filesystem on the MSC disk, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define FAT_NAME_MAX    64          // Max length of a path component
+#define FAT_DIR_SIZE    32          // Directory entry size
+#define FAT_ATTR_DIR    0x10
+#define FAT_ATTR_LFN    0x0f
+#define FAT_ATTR_VOL    0x08
+
+// Volume layout, as byte addresses on the disk
+typedef struct {
+    uint32_t fat_addr, root_addr, data_addr;
+    uint32_t root_entries, clust_size, nclusts;
+    int fat_bits;
+} FAT_VOL;
+
+// Open file; the current cluster is kept for sequential reads
+typedef struct {
+    uint32_t start, size;
+    uint32_t clust, clust_pos;
+    bool dir;
+} FAT_FILE;
+
+extern FAT_VOL fat_vol;
+
+bool fat_mount(void);
+bool fat_open(char *path, FAT_FILE *fp);
+int fat_read(FAT_FILE *fp, uint32_t pos, void *buff, int len);
+
+#endif
+// EOF
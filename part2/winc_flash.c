@@ -33,6 +33,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "winc_flash.h"
 #define DUMMY_REGISTER	(0x1084)
 
@@ -40,11 +41,33 @@
 
 //#define DISABLE_UNSED_FLASH_FUNCTIONS
 
+#ifndef FLASH_PIPELINE_WRITE
+#define FLASH_PIPELINE_WRITE	1
+/*!<Upload next page to a 2nd staging area while the flash is programming
+ */
+#endif
+
 #define FLASH_BLOCK_SIZE					(32UL * 1024)
 /*!<Block Size in Flash Memory
  */
-#define FLASH_PAGE_SZ						(256)
-/*!<Page Size in Flash Memory */
+#define FLASH_BLOCK64_SZ					(64UL * 1024)
+/*!<Large Block Size in Flash Memory
+ */
+
+#define FLASH_CMD_SECTOR_ERASE		0x20
+#define FLASH_CMD_BLOCK32_ERASE		0x52
+#define FLASH_CMD_BLOCK64_ERASE		0xd8
+#define FLASH_CMD_CHIP_ERASE		0xc7
+
+FLASH_STATS flash_stats;
+
+/* sector erase started by spi_flash_rewrite_step, not yet complete */
+static uint8_t gu8EraseBusy;
+static uint32_t gu32EraseStart;
+
+/* idle power-down state */
+static uint8_t gu8FlashAsleep;
+static uint32_t gu32FlashLastUse, gu32FlashSleepStart, gu32FlashIdleUsec;
 
 #define HOST_SHARE_MEM_BASE		(0xd0000UL)
 #define CORTUS_SHARE_MEM_BASE	(0x60000000UL)
@@ -149,6 +172,75 @@ static int8_t spi_flash_read_status_reg(int fd, uint8_t * val)
 	return ret;
 }
 
+/**
+*	@fn			spi_flash_op_done
+*	@brief		Record the duration of a completed program or erase operation
+*	@param[IN]	u8Op
+*					Operation type, FLASH_OP_PROGRAM or one of FLASH_ERASE_xx
+*	@param[IN]	u32Start
+*					Time (usec) the operation was started
+*/
+static void spi_flash_op_done(uint8_t u8Op, uint32_t u32Start)
+{
+	uint32_t u32Dur = usec() - u32Start, u32Bin = 0;
+
+	if (!flash_stats.op_count[u8Op] || u32Dur < flash_stats.op_min[u8Op])
+		flash_stats.op_min[u8Op] = u32Dur;
+	if (u32Dur > flash_stats.op_max[u8Op])
+		flash_stats.op_max[u8Op] = u32Dur;
+	flash_stats.op_count[u8Op]++;
+	flash_stats.op_usec[u8Op] += u32Dur;
+	while ((u32Dur >>= 1) != 0 && u32Bin < FLASH_HIST_BINS-1)
+		u32Bin++;
+	flash_stats.op_hist[u8Op][u32Bin]++;
+}
+
+/**
+*	@fn			spi_flash_wait_ready
+*	@brief		Wait for a program or erase operation to complete
+*	@param[IN]	u8Op
+*					Operation type, FLASH_OP_PROGRAM or one of FLASH_ERASE_xx
+*	@param[IN]	u32Start
+*					Time (usec) the operation was started
+*	@return		Status of execution
+*	@note		Waits without bus activity for the shortest time seen so far for
+*				this type of operation, then polls the status register with an
+*				increasing interval, so the SPI bus isn't flooded with polls
+*				during a long operation. Actual durations go into a histogram.
+*				This blocks until the operation is complete, with no WiFi events
+*				serviced in the meantime; use spi_flash_rewrite_step to erase
+*				without blocking
+*/
+static int8_t spi_flash_wait_ready(int fd, uint8_t u8Op, uint32_t u32Start)
+{
+	int8_t ret = M2M_SUCCESS;
+	uint32_t u32Min = flash_stats.op_min[u8Op], u32Delay = FLASH_POLL_MIN_USEC;
+	uint32_t u32MaxDelay = BSP_MIN(FLASH_POLL_MAX_USEC, u32Min / 16), t;
+	uint8_t tmp;
+
+	if (flash_stats.op_count[u8Op])
+	{
+		while (usec() - u32Start < u32Min) ;
+	}
+	while (1)
+	{
+		if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS) {
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		flash_stats.op_polls[u8Op]++;
+		if (!(tmp & 0x01))
+			break;
+		t = usec();
+		while (usec() - t < u32Delay) ;
+		if (u32Delay < u32MaxDelay)
+			u32Delay *= 2;
+	}
+	spi_flash_op_done(u8Op, u32Start);
+ERR:
+	return ret;
+}
+
 #ifdef DISABLE_UNSED_FLASH_FUNCTIONS
 /**
 *	@fn			spi_flash_read_security_reg
@@ -266,8 +358,8 @@ static int8_t spi_flash_clear_security_flags(int fd)
 #endif
 
 /**
-*	@fn			spi_flash_load_to_cortus_mem
-*	@brief		Load data from SPI flash into cortus memory
+*	@fn			spi_flash_load_start
+*	@brief		Start loading data from SPI flash into cortus memory, without waiting
 *	@param[IN]	u32MemAdr
 *					Cortus load address. It must be set to its AHB access address
 *	@param[IN]	u32FlashAdr
@@ -275,14 +367,11 @@ static int8_t spi_flash_clear_security_flags(int fd)
 *	@param[IN]	u32Sz
 *					Data size
 *	@return		Status of execution
-*	@note		Compatible with MX25L6465E and should be working with other types
-*	@author		M. Abdelmawla
-*	@version	1.0
+*	@note		Must be followed by spi_flash_load_wait before the data is used
 */
-static int8_t spi_flash_load_to_cortus_mem(int fd, uint32_t u32MemAdr, uint32_t u32FlashAdr, uint32_t u32Sz)
+static int8_t spi_flash_load_start(int fd, uint32_t u32MemAdr, uint32_t u32FlashAdr, uint32_t u32Sz)
 {
 	uint8_t cmd[5];
-	uint32_t	val	= 0;
 	int8_t	ret = M2M_SUCCESS;
 
 	cmd[0] = 0x0b;
@@ -300,6 +389,19 @@ static int8_t spi_flash_load_to_cortus_mem(int fd, uint32_t u32MemAdr, uint32_t
     {
         ret = M2M_ERR_FAIL;
     }
+	return ret;
+}
+
+/**
+*	@fn			spi_flash_load_wait
+*	@brief		Wait for flash controller transfer to complete
+*	@return		Status of execution
+*/
+static int8_t spi_flash_load_wait(int fd)
+{
+	uint32_t	val	= 0;
+	int8_t	ret = M2M_SUCCESS;
+
 	do
 	{
 		if (!spi_read_reg(fd, SPI_FLASH_TR_DONE, (uint32_t *)&val))
@@ -309,36 +411,61 @@ static int8_t spi_flash_load_to_cortus_mem(int fd, uint32_t u32MemAdr, uint32_t
         }
 	}
 	while(val != 1);
+	return ret;
+}
 
+/**
+*	@fn			spi_flash_load_to_cortus_mem
+*	@brief		Load data from SPI flash into cortus memory
+*	@param[IN]	u32MemAdr
+*					Cortus load address. It must be set to its AHB access address
+*	@param[IN]	u32FlashAdr
+*					Address to read from at the SPI flash
+*	@param[IN]	u32Sz
+*					Data size
+*	@return		Status of execution
+*	@note		Compatible with MX25L6465E and should be working with other types
+*	@author		M. Abdelmawla
+*	@version	1.0
+*/
+static int8_t spi_flash_load_to_cortus_mem(int fd, uint32_t u32MemAdr, uint32_t u32FlashAdr, uint32_t u32Sz)
+{
+	int8_t	ret = spi_flash_load_start(fd, u32MemAdr, u32FlashAdr, u32Sz);
+
+	if (spi_flash_load_wait(fd) != M2M_SUCCESS)
+		ret = M2M_ERR_FAIL;
 	return ret;
 }
 
 /**
 *	@fn			spi_flash_sector_erase
-*	@brief		Erase sector (4KB)
+*	@brief		Erase sector (4KB), block (32KB or 64KB) or whole chip
+*	@param[IN]	u8Cmd
+*					Erase command: 0x20 sector, 0x52 32KB block, 0xd8 64KB block, 0xc7 chip
 *	@param[IN]	u32FlashAdr
-*					Any memory address within the sector
+*					Any memory address within the sector or block (ignored for chip erase)
 *	@return		Status of execution
 *	@note		Compatible with MX25L6465E and should be working with other types
 *	@author		M. Abdelmawla
 *	@version	1.0
 */
-static int8_t spi_flash_sector_erase(int fd, uint32_t u32FlashAdr)
+static int8_t spi_flash_sector_erase(int fd, uint8_t u8Cmd, uint32_t u32FlashAdr)
 {
 	uint8_t cmd[4];
 	uint32_t	val	= 0;
 	int8_t	ret = M2M_SUCCESS;
+	uint8_t len = u8Cmd == FLASH_CMD_CHIP_ERASE ? 1 : 4;
 
-	cmd[0] = 0x20;
+	cmd[0] = u8Cmd;
 	cmd[1] = (uint8_t)(u32FlashAdr >> 16);
 	cmd[2] = (uint8_t)(u32FlashAdr >> 8);
 	cmd[3] = (uint8_t)(u32FlashAdr);
 
 	if (!spi_write_reg(fd, SPI_FLASH_DATA_CNT, 0) ||
         !spi_write_reg(fd, SPI_FLASH_BUF1, cmd[0]|(((uint32_t)cmd[1])<<8)|(((uint32_t)cmd[2])<<16)|(((uint32_t)cmd[3])<<24)) ||
-        !spi_write_reg(fd, SPI_FLASH_BUF_DIR, 0x0f) ||
+        !spi_write_reg(fd, SPI_FLASH_BUF_DIR, len == 1 ? 0x01 : 0x0f) ||
         !spi_write_reg(fd, SPI_FLASH_DMA_ADDR, 0) ||
-        !spi_write_reg(fd, SPI_FLASH_CMD_CNT, 4 | (1<<7)))
+        !spi_write_reg(fd, SPI_FLASH_CMD_CNT, len | (1<<7)))
     {
         ret = M2M_ERR_FAIL;
     }
@@ -392,6 +519,7 @@ static int8_t spi_flash_write_enable(int fd)
 	return ret;
 }
 
+#if !FLASH_PIPELINE_WRITE
 /**
 *	@fn			spi_flash_write_disable
 *	@brief		Send write disable command to SPI flash
@@ -426,6 +554,7 @@ static int8_t spi_flash_write_disable(int fd)
 
 	return ret;
 }
+#endif
 
 /**
 *	@fn			spi_flash_page_program
@@ -502,6 +631,75 @@ ERR:
 	return ret;
 }
 
+/**
+*	@fn			spi_flash_read_pipe
+*	@brief		Read from SPI flash in chunks, alternating between two shared
+*				memory areas, so the controller loads the next chunk while the
+*				previous one is transferred over SPI
+*	@param[OUT]	pu8Buf
+*					Pointer to data buffer
+*	@param[IN]	bAdvance
+*					Move along data buffer after each chunk, else re-use the start
+*	@param[IN]	u32Addr
+*					Address to read from at the SPI flash
+*	@param[IN]	u32Sz
+*					Data size
+*	@param[IN]	u32Chunk
+*					Chunk size, not greater than FLASH_STREAM_MAX
+*	@param[IN]	handler
+*					Optional function called with each chunk; returns false to stop
+*	@return		Status of execution
+*/
+static int8_t spi_flash_read_pipe(int fd, uint8_t *pu8Buf, bool bAdvance, uint32_t u32Addr,
+	uint32_t u32Sz, uint32_t u32Chunk, FLASH_READ_HANDLER handler, void *ctx)
+{
+	int8_t ret = M2M_SUCCESS;
+	uint32_t t = usec(), u32Sz0 = u32Sz, u32Buf = 0, u32rsz, u32nsz;
+
+	u32rsz = BSP_MIN(u32Sz, u32Chunk);
+	if (spi_flash_load_to_cortus_mem(fd, HOST_SHARE_MEM_BASE, u32Addr, u32rsz) != M2M_SUCCESS)
+	{
+		ret = M2M_ERR_FAIL;
+		goto ERR;
+	}
+	while (u32Sz > 0)
+	{
+		/* start loading next chunk into other area... */
+		u32nsz = BSP_MIN(u32Sz - u32rsz, u32Chunk);
+		if (u32nsz && spi_flash_load_start(fd, HOST_SHARE_MEM_BASE + (u32Buf^1)*FLASH_STREAM_MAX,
+				u32Addr + u32rsz, u32nsz) != M2M_SUCCESS)
+		{
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		/* ...while transferring this one */
+		if (!spi_read_data(fd, HOST_SHARE_MEM_BASE + u32Buf*FLASH_STREAM_MAX, pu8Buf, u32rsz) ||
+			(handler && !handler(ctx, u32Addr, pu8Buf, u32rsz)))
+		{
+			if (u32nsz)
+				spi_flash_load_wait(fd);
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		if (u32nsz && spi_flash_load_wait(fd) != M2M_SUCCESS)
+		{
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		if (bAdvance)
+			pu8Buf += u32rsz;
+		u32Addr += u32rsz;
+		u32Sz -= u32rsz;
+		u32rsz = u32nsz;
+		u32Buf ^= 1;
+	}
+	flash_stats.read_bytes += u32Sz0;
+	flash_stats.read_usec += usec() - t;
+ERR:
+	return ret;
+}
+
+#if !FLASH_PIPELINE_WRITE
 /**
 *	@fn			spi_flash_pp
 *	@brief		Program data of size less than a page (256 bytes) at the SPI flash
@@ -518,7 +716,6 @@ ERR:
 static int8_t spi_flash_pp(int fd, uint32_t u32Offset, uint8_t *pu8Buf, uint16_t u16Sz)
 {
 	int8_t ret = M2M_SUCCESS;
-	uint8_t tmp;
 
 	if (spi_flash_write_enable(fd) != M2M_SUCCESS) {
 		ret = M2M_ERR_FAIL;
@@ -536,18 +733,11 @@ static int8_t spi_flash_pp(int fd, uint32_t u32Offset, uint8_t *pu8Buf, uint16_t
 		goto ERR;
 	}
 
-	if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS) {
+	if (spi_flash_wait_ready(fd, FLASH_OP_PROGRAM, usec()) != M2M_SUCCESS) {
 		ret = M2M_ERR_FAIL;
 		goto ERR;
 	}
 
-	do {
-		if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS) {
-			ret = M2M_ERR_FAIL;
-			goto ERR;
-		}
-	} while(tmp & 0x01);
-
 	if (spi_flash_write_disable(fd) != M2M_SUCCESS) {
 		ret = M2M_ERR_FAIL;
 	}
@@ -556,6 +746,8 @@ ERR:
 	return ret;
 }
 
+#endif
+
 /**
 *	@fn			spi_flash_rdid
 *	@brief		Read SPI Flash ID
@@ -658,6 +850,49 @@ static void spi_flash_leave_low_power_mode(int fd) {
             break;
     } while (reg != 1);
 }
+/**
+*	@fn			spi_flash_erase_done
+*	@brief		Update statistics when a stepped sector erase is complete
+*/
+static void spi_flash_erase_done(void)
+{
+	gu8EraseBusy = 0;
+	flash_stats.erase_count[FLASH_ERASE_4K]++;
+	flash_stats.erase_usec[FLASH_ERASE_4K] += usec() - gu32EraseStart;
+	flash_stats.erases++;
+}
+
+/**
+*	@fn			spi_flash_wake
+*	@brief		Wake flash from deep power-down if necessary, and note the time
+*				of use for the idle timer
+*/
+static void spi_flash_wake(int fd)
+{
+	uint32_t t = usec(), u32Dur;
+
+	if (gu8FlashAsleep)
+	{
+		spi_flash_leave_low_power_mode(fd);
+		while (usec() - t < FLASH_WAKE_USEC) ;
+		gu8FlashAsleep = 0;
+		u32Dur = usec() - t;
+		flash_stats.wakes++;
+		flash_stats.sleep_usec += t - gu32FlashSleepStart;
+		flash_stats.wake_usec += u32Dur;
+		if (u32Dur > flash_stats.wake_max)
+			flash_stats.wake_max = u32Dur;
+		t = usec();
+	}
+	gu32FlashLastUse = t;
+	if (gu8EraseBusy)
+	{
+		/* let a stepped erase finish before any other access */
+		spi_flash_wait_ready(fd, FLASH_ERASE_4K, gu32EraseStart);
+		spi_flash_erase_done();
+	}
+}
+
 /*********************************************/
 /* GLOBAL FUNCTIONS							 */
 /*********************************************/
@@ -686,6 +921,8 @@ int8_t spi_flash_enable(int fd, uint8_t enable)
 			u32Val |= ((0x1111ul) << 12);
 			spi_write_reg(fd, 0x1410, u32Val);
 			spi_flash_leave_low_power_mode(fd);
+			gu8FlashAsleep = 0;
+			gu32FlashLastUse = usec();
 		} else {
 			spi_flash_enter_low_power_mode(fd);
 			/* Disable pinmux to SPI flash to minimize leakage. */
@@ -713,24 +950,45 @@ ERR1:
 int8_t spi_flash_read(int fd, uint8_t *pu8Buf, uint32_t u32offset, uint32_t u32Sz)
 {
 	int8_t ret = M2M_SUCCESS;
-	if(u32Sz > FLASH_BLOCK_SIZE)
-	{
-		do
-		{
-			ret = spi_flash_read_internal(fd, pu8Buf, u32offset, FLASH_BLOCK_SIZE);
-			if(M2M_SUCCESS != ret) goto ERR;
-			u32Sz -= FLASH_BLOCK_SIZE;
-			u32offset += FLASH_BLOCK_SIZE;
-			pu8Buf += FLASH_BLOCK_SIZE;
-		} while(u32Sz > FLASH_BLOCK_SIZE);
-	}
+	uint32_t t;
 
+	spi_flash_wake(fd);
+	if(u32Sz > FLASH_STREAM_MAX)
+		return spi_flash_read_pipe(fd, pu8Buf, true, u32offset, u32Sz, FLASH_STREAM_MAX, 0, 0);
+	t = usec();
 	ret = spi_flash_read_internal(fd, pu8Buf, u32offset, u32Sz);
-
-ERR:
+	flash_stats.read_bytes += u32Sz;
+	flash_stats.read_usec += usec() - t;
 	return ret;
 }
 
+/**
+*	@fn			spi_flash_read_stream
+*	@brief		Stream data from SPI flash to a handler function, one chunk at a time
+*	@param[IN]	u32Addr
+*					Address to read from at the SPI flash
+*	@param[IN]	u32Sz
+*					Data size
+*	@param[IN]	pu8Buf
+*					Buffer for one chunk, re-used for each chunk
+*	@param[IN]	u32Chunk
+*					Chunk size, up to FLASH_STREAM_MAX
+*	@param[IN]	handler
+*					Called with the flash address, data & length of each chunk;
+*					returns false to abort the transfer
+*	@return		Status of execution
+*	@note		Loading of the next chunk by the flash controller overlaps
+*				the SPI transfer & handling of the current chunk
+*/
+int8_t spi_flash_read_stream(int fd, uint32_t u32Addr, uint32_t u32Sz, uint8_t *pu8Buf,
+	uint32_t u32Chunk, FLASH_READ_HANDLER handler, void *ctx)
+{
+	if (u32Sz == 0 || u32Chunk == 0 || u32Chunk > FLASH_STREAM_MAX || !handler)
+		return M2M_ERR_FAIL;
+	spi_flash_wake(fd);
+	return spi_flash_read_pipe(fd, pu8Buf, false, u32Addr, u32Sz, u32Chunk, handler, ctx);
+}
+
 /**
 *	@fn			spi_flash_write
 *	@brief		Program SPI flash
@@ -747,6 +1005,55 @@ ERR:
 int8_t spi_flash_write(int fd, uint8_t* pu8Buf, uint32_t u32Offset, uint32_t u32Sz)
 {
 	int8_t ret = M2M_SUCCESS;
+	uint32_t t = usec(), u32Sz0 = u32Sz;
+
+	spi_flash_wake(fd);
+#if FLASH_PIPELINE_WRITE
+	uint32_t u32wsz, u32nsz, u32Buf = 0, u32Start;
+
+	if(u32Sz<=0)
+	{
+		M2M_ERR("Data size = %d",(int)u32Sz);
+		ret = M2M_ERR_FAIL;
+		goto ERR;
+	}
+	/* first part of data may be in the middle of a page */
+	u32wsz = BSP_MIN(u32Sz, FLASH_PAGE_SZ - u32Offset % FLASH_PAGE_SZ);
+	if (!spi_write_data(fd, HOST_SHARE_MEM_BASE, pu8Buf, u32wsz))
+	{
+		ret = M2M_ERR_FAIL;
+		goto ERR;
+	}
+	while (u32Sz > 0)
+	{
+		/* program page from one staging area... */
+		if (spi_flash_write_enable(fd) != M2M_SUCCESS ||
+			spi_flash_page_program(fd, HOST_SHARE_MEM_BASE + u32Buf*FLASH_PAGE_SZ,
+				u32Offset, u32wsz) != M2M_SUCCESS)
+		{
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		u32Start = usec();
+		pu8Buf += u32wsz;
+		u32Offset += u32wsz;
+		u32Sz -= u32wsz;
+		/* ...while next page is uploaded to the other */
+		u32Buf ^= 1;
+		u32nsz = BSP_MIN(u32Sz, FLASH_PAGE_SZ);
+		if (u32nsz && !spi_write_data(fd, HOST_SHARE_MEM_BASE + u32Buf*FLASH_PAGE_SZ, pu8Buf, u32nsz))
+		{
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		/* write enable latch is cleared by flash when program completes */
+		if (spi_flash_wait_ready(fd, FLASH_OP_PROGRAM, u32Start) != M2M_SUCCESS) {
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		u32wsz = u32nsz;
+	}
+#else
 	uint32_t u32wsz;
 	uint32_t u32off;
 	uint32_t u32Blksz;
@@ -787,6 +1094,9 @@ int8_t spi_flash_write(int fd, uint8_t* pu8Buf, uint32_t u32Offset, uint32_t u32
 		u32Sz -= u32wsz;
 	}
 EXIT:
+#endif
+	flash_stats.write_bytes += u32Sz0;
+	flash_stats.write_usec += usec() - t;
 ERR:
 	return ret;
 }
@@ -805,36 +1115,49 @@ ERR:
 */
 int8_t spi_flash_erase(int fd, uint32_t u32Offset, uint32_t u32Sz)
 {
-	uint32_t i = 0;
+	uint32_t i, u32End, u32Step, t, u32FlashSz;
 	int8_t ret = M2M_SUCCESS;
-	uint8_t  tmp = 0;
+	uint8_t  u8Cmd, u8Type;
+
 	M2M_PRINT("\r\n>Start erasing...\r\n");
-	for(i = u32Offset; i < (u32Sz +u32Offset); i += (16*FLASH_PAGE_SZ))
+	spi_flash_wake(fd);
+	u32End = u32Offset + u32Sz;
+	u32End = (u32End + FLASH_SECTOR_SZ - 1) & ~(FLASH_SECTOR_SZ - 1);
+	i = u32Offset & ~(FLASH_SECTOR_SZ - 1);
+	u32FlashSz = spi_flash_get_size(fd) * 1024 * 1024 / 8;
+	while (i < u32End)
 	{
-		if (spi_flash_write_enable(fd) != M2M_SUCCESS) {
-			ret = M2M_ERR_FAIL;
-			goto ERR;
-		}
-		if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS) {
-			ret = M2M_ERR_FAIL;
-			goto ERR;
+		/* use the largest erase that is aligned, and fits in the span */
+		if (i == 0 && u32FlashSz && u32End >= u32FlashSz) {
+			u8Cmd = FLASH_CMD_CHIP_ERASE;
+			u8Type = FLASH_ERASE_CHIP;
+			u32Step = u32End;
+		} else if (i % FLASH_BLOCK64_SZ == 0 && u32End - i >= FLASH_BLOCK64_SZ) {
+			u8Cmd = FLASH_CMD_BLOCK64_ERASE;
+			u8Type = FLASH_ERASE_64K;
+			u32Step = FLASH_BLOCK64_SZ;
+		} else if (i % FLASH_BLOCK_SIZE == 0 && u32End - i >= FLASH_BLOCK_SIZE) {
+			u8Cmd = FLASH_CMD_BLOCK32_ERASE;
+			u8Type = FLASH_ERASE_32K;
+			u32Step = FLASH_BLOCK_SIZE;
+		} else {
+			u8Cmd = FLASH_CMD_SECTOR_ERASE;
+			u8Type = FLASH_ERASE_4K;
+			u32Step = FLASH_SECTOR_SZ;
 		}
-		if (spi_flash_sector_erase(fd, i + 10) != M2M_SUCCESS) {
+		t = usec();
+		if (spi_flash_write_enable(fd) != M2M_SUCCESS) {
 			ret = M2M_ERR_FAIL;
 			goto ERR;
 		}
-		if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS) {
+		if (spi_flash_sector_erase(fd, u8Cmd, i) != M2M_SUCCESS ||
+			spi_flash_wait_ready(fd, u8Type, usec()) != M2M_SUCCESS) {
 			ret = M2M_ERR_FAIL;
 			goto ERR;
 		}
-		do
-		{
-			if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS) {
-				ret = M2M_ERR_FAIL;
-				goto ERR;
-			}
-		}while(tmp & 0x01);
-
+		flash_stats.erase_count[u8Type]++;
+		flash_stats.erase_usec[u8Type] += usec() - t;
+		i += u32Step;
 	}
 	M2M_PRINT("Done\r\n");
 ERR:
@@ -855,6 +1178,7 @@ uint32_t spi_flash_get_size(int fd)
 
 	if(!gu32InternalFlashSize)
 	{
+		spi_flash_wake(fd);
 		u32FlashId = spi_flash_rdid(fd);
 		printf("Flash ID: 0x%X\n", u32FlashId);
 		if((u32FlashId != 0xffffffff) && (u32FlashId !=0))
@@ -873,3 +1197,284 @@ uint32_t spi_flash_get_size(int fd)
 
 	return gu32InternalFlashSize;
 }
+
+/* rewrite step states */
+#define REWRITE_ERASE		0
+#define REWRITE_ERASE_WAIT	1
+#define REWRITE_PROGRAM		2
+
+/**
+*	@fn			spi_flash_rewrite_start
+*	@brief		Prepare to rewrite a sector in steps, given its current contents.
+*				The sector is only erased if some bit has to change from 0 to 1;
+*				otherwise only the pages that differ are programmed
+*	@param[OUT]	pstrRw
+*					Rewrite state, for spi_flash_rewrite_step
+*	@param[IN]	pu8New
+*					New sector data (FLASH_SECTOR_SZ bytes), must be unchanged until done
+*	@param[IN]	pu8Old
+*					Current sector data, as read from the flash
+*	@param[IN]	u32Addr
+*					Address of the sector at the SPI flash
+*/
+void spi_flash_rewrite_start(FLASH_REWRITE *pstrRw, uint8_t *pu8New, uint8_t *pu8Old, uint32_t u32Addr)
+{
+	uint32_t i;
+
+	pstrRw->pu8New = pu8New;
+	pstrRw->pu8Old = pu8Old;
+	pstrRw->u32Addr = u32Addr - u32Addr % FLASH_SECTOR_SZ;
+	pstrRw->u32Page = 0;
+	pstrRw->u8Erase = 0;
+	for (i = 0; i < FLASH_SECTOR_SZ && !pstrRw->u8Erase; i++)
+	{
+		if ((pu8Old[i] & pu8New[i]) != pu8New[i])
+			pstrRw->u8Erase = 1;
+	}
+	pstrRw->u8State = pstrRw->u8Erase ? REWRITE_ERASE : REWRITE_PROGRAM;
+}
+
+/**
+*	@fn			spi_flash_rewrite_step
+*	@brief		Do the next step of a sector rewrite: start the erase, check
+*				whether it has finished, or program one page
+*	@param[IN]	pstrRw
+*					Rewrite state, from spi_flash_rewrite_start
+*	@return		FLASH_STEP_MORE if more steps are needed, M2M_SUCCESS when
+*				complete, or error status
+*	@note		None of the steps wait for an erase to finish, so other work
+*				can be done between steps; any other flash access in the
+*				meantime will wait for the erase to finish
+*/
+int8_t spi_flash_rewrite_step(int fd, FLASH_REWRITE *pstrRw)
+{
+	uint32_t j;
+	uint8_t tmp, program = 0;
+
+	switch (pstrRw->u8State)
+	{
+	case REWRITE_ERASE:
+		spi_flash_wake(fd);
+		if (spi_flash_write_enable(fd) != M2M_SUCCESS ||
+			spi_flash_sector_erase(fd, FLASH_CMD_SECTOR_ERASE, pstrRw->u32Addr) != M2M_SUCCESS)
+			return M2M_ERR_FAIL;
+		gu32EraseStart = usec();
+		gu8EraseBusy = 1;
+		pstrRw->u8State = REWRITE_ERASE_WAIT;
+		return FLASH_STEP_MORE;
+
+	case REWRITE_ERASE_WAIT:
+		/* erase may have been completed by another flash access */
+		if (gu8EraseBusy)
+		{
+			/* don't poll until the shortest erase time has elapsed */
+			if (flash_stats.op_count[FLASH_ERASE_4K] &&
+				usec() - gu32EraseStart < flash_stats.op_min[FLASH_ERASE_4K])
+				return FLASH_STEP_MORE;
+			if (spi_flash_read_status_reg(fd, &tmp) != M2M_SUCCESS)
+				return M2M_ERR_FAIL;
+			flash_stats.op_polls[FLASH_ERASE_4K]++;
+			if (tmp & 0x01)
+				return FLASH_STEP_MORE;
+			spi_flash_op_done(FLASH_ERASE_4K, gu32EraseStart);
+			spi_flash_erase_done();
+		}
+		pstrRw->u8State = REWRITE_PROGRAM;
+		return FLASH_STEP_MORE;
+
+	default:
+		spi_flash_wake(fd);
+		/* after erase, skip blank pages; otherwise skip unchanged pages */
+		for (; pstrRw->u32Page < FLASH_SECTOR_SZ && !program; pstrRw->u32Page += FLASH_PAGE_SZ)
+		{
+			for (j = pstrRw->u32Page; j < pstrRw->u32Page + FLASH_PAGE_SZ && !program; j++)
+				program = pstrRw->u8Erase ? pstrRw->pu8New[j] != 0xff : pstrRw->pu8New[j] != pstrRw->pu8Old[j];
+			if (!program)
+				flash_stats.pages_skipped++;
+			else if (spi_flash_write(fd, &pstrRw->pu8New[pstrRw->u32Page],
+						pstrRw->u32Addr + pstrRw->u32Page, FLASH_PAGE_SZ) != M2M_SUCCESS)
+				return M2M_ERR_FAIL;
+			else
+				flash_stats.pages_written++;
+		}
+		return pstrRw->u32Page < FLASH_SECTOR_SZ ? FLASH_STEP_MORE : M2M_SUCCESS;
+	}
+}
+
+/**
+*	@fn			spi_flash_rewrite_abort
+*	@brief		Abandon a rewrite done in steps; if its erase has been started,
+*				wait for it to finish, so the flash isn't left busy
+*	@param[IN]	pstrRw
+*					Rewrite state, from spi_flash_rewrite_start
+*/
+void spi_flash_rewrite_abort(int fd, FLASH_REWRITE *pstrRw)
+{
+	if (pstrRw->u8State == REWRITE_ERASE_WAIT && gu8EraseBusy)
+		spi_flash_wake(fd);
+	pstrRw->u8State = REWRITE_PROGRAM;
+	pstrRw->u32Page = FLASH_SECTOR_SZ;
+}
+
+/**
+*	@fn			spi_flash_rewrite_sector
+*	@brief		Rewrite a sector, given its current contents. The sector is only
+*				erased if some bit has to change from 0 to 1; otherwise only the
+*				pages that differ are programmed
+*	@param[IN]	pu8New
+*					New sector data (FLASH_SECTOR_SZ bytes)
+*	@param[IN]	pu8Old
+*					Current sector data, as read from the flash
+*	@param[IN]	u32Addr
+*					Address of the sector at the SPI flash
+*	@return		Status of execution
+*/
+int8_t spi_flash_rewrite_sector(int fd, uint8_t *pu8New, uint8_t *pu8Old, uint32_t u32Addr)
+{
+	FLASH_REWRITE strRw;
+	int8_t ret;
+
+	spi_flash_rewrite_start(&strRw, pu8New, pu8Old, u32Addr);
+	while ((ret = spi_flash_rewrite_step(fd, &strRw)) == FLASH_STEP_MORE) ;
+	return ret;
+}
+
+/**
+*	@fn			spi_flash_update
+*	@brief		Update an area of SPI flash with a new image, only erasing and
+*				programming the sectors that have changed
+*	@param[IN]	pu8Buf
+*					Pointer to new data
+*	@param[IN]	u32Offset
+*					Address to write to at the SPI flash
+*	@param[IN]	u32Sz
+*					Data size
+*	@param[OUT]	pstrResult
+*					Optional pointer to sector counts and time taken
+*	@return		Status of execution
+*	@note		Each sector is read back and compared with the new data; partial
+*				sectors at the start and end are merged with the existing data
+*/
+int8_t spi_flash_update(int fd, uint8_t *pu8Buf, uint32_t u32Offset, uint32_t u32Sz,
+	FLASH_UPDATE_RESULT *pstrResult)
+{
+	static uint8_t old_buff[FLASH_SECTOR_SZ], new_buff[FLASH_SECTOR_SZ];
+	FLASH_UPDATE_RESULT res = {0};
+	int8_t ret = M2M_SUCCESS;
+	uint32_t t = usec(), u32Sect, u32Oset, u32n, u32Erases = flash_stats.erases;
+	uint8_t *pu8New;
+
+	while (u32Sz > 0)
+	{
+		u32Sect = u32Offset - u32Offset % FLASH_SECTOR_SZ;
+		u32Oset = u32Offset - u32Sect;
+		u32n = BSP_MIN(u32Sz, FLASH_SECTOR_SZ - u32Oset);
+		if (spi_flash_read(fd, old_buff, u32Sect, FLASH_SECTOR_SZ) != M2M_SUCCESS)
+		{
+			ret = M2M_ERR_FAIL;
+			goto ERR;
+		}
+		res.sectors++;
+		if (memcmp(&old_buff[u32Oset], pu8Buf, u32n) == 0)
+			res.skipped++;
+		else
+		{
+			pu8New = pu8Buf;
+			if (u32n < FLASH_SECTOR_SZ)
+			{
+				memcpy(new_buff, old_buff, FLASH_SECTOR_SZ);
+				memcpy(&new_buff[u32Oset], pu8Buf, u32n);
+				pu8New = new_buff;
+			}
+			if (spi_flash_rewrite_sector(fd, pu8New, old_buff, u32Sect) != M2M_SUCCESS)
+			{
+				ret = M2M_ERR_FAIL;
+				goto ERR;
+			}
+		}
+		pu8Buf += u32n;
+		u32Offset += u32n;
+		u32Sz -= u32n;
+	}
+ERR:
+	res.erased = flash_stats.erases - u32Erases;
+	res.usec = usec() - t;
+	if (pstrResult)
+		*pstrResult = res;
+	return ret;
+}
+
+/**
+*	@fn			spi_flash_set_idle
+*	@brief		Set time without flash access before deep power-down
+*	@param[IN]	u32Msec
+*					Idle time in milliseconds, 0 to disable power-down
+*/
+void spi_flash_set_idle(uint32_t u32Msec)
+{
+	gu32FlashIdleUsec = u32Msec * 1000;
+}
+
+/**
+*	@fn			spi_flash_idle
+*	@brief		Put flash into deep power-down if it hasn't been used for the
+*				idle time; call regularly. The next read, write or erase wakes it.
+*				Not while a stepped erase is in progress
+*/
+void spi_flash_idle(int fd)
+{
+	if (!gu8FlashAsleep && !gu8EraseBusy && gu32FlashIdleUsec && gu32FlashLastUse &&
+		usec() - gu32FlashLastUse > gu32FlashIdleUsec)
+	{
+		spi_flash_enter_low_power_mode(fd);
+		gu8FlashAsleep = 1;
+		gu32FlashSleepStart = usec();
+		flash_stats.sleeps++;
+	}
+}
+
+/**
+*	@fn			spi_flash_stats_print
+*	@brief		Display flash operation statistics
+*/
+void spi_flash_stats_print(void)
+{
+	static const char *names[FLASH_ERASE_TYPES] = {"4K", "32K", "64K", "chip"};
+	int i, j;
+
+	printf("Flash read %lu KB in %lu ms (%lu KB/s)\n",
+		flash_stats.read_bytes / 1024, flash_stats.read_usec / 1000,
+		flash_stats.read_usec ? (uint32_t)(flash_stats.read_bytes * 1000ULL / flash_stats.read_usec) : 0);
+	printf("Flash write %lu KB in %lu ms (%lu KB/s)\n",
+		flash_stats.write_bytes / 1024, flash_stats.write_usec / 1000,
+		flash_stats.write_usec ? (uint32_t)(flash_stats.write_bytes * 1000ULL / flash_stats.write_usec) : 0);
+	for (i = 0; i < FLASH_ERASE_TYPES; i++)
+	{
+		if (flash_stats.erase_count[i])
+			printf("Flash erase %s: %lu in %lu ms (%lu ms each)\n", names[i],
+				flash_stats.erase_count[i], flash_stats.erase_usec[i] / 1000,
+				flash_stats.erase_usec[i] / 1000 / flash_stats.erase_count[i]);
+	}
+	if (flash_stats.sleeps)
+		printf("Flash power-down: %lu sleeps, asleep %lu ms, %lu wakes (avg %lu max %lu usec)\n",
+			flash_stats.sleeps, (flash_stats.sleep_usec +
+			(gu8FlashAsleep ? usec() - gu32FlashSleepStart : 0)) / 1000, flash_stats.wakes,
+			flash_stats.wakes ? flash_stats.wake_usec / flash_stats.wakes : 0, flash_stats.wake_max);
+	for (i = 0; i < FLASH_OPS; i++)
+	{
+		if (!flash_stats.op_count[i])
+			continue;
+		printf("Flash %s %s: %lu ops, min %lu avg %lu max %lu usec, %lu polls/op\n",
+			i == FLASH_OP_PROGRAM ? "program" : "erase", i == FLASH_OP_PROGRAM ? "page" : names[i],
+			flash_stats.op_count[i], flash_stats.op_min[i],
+			flash_stats.op_usec[i] / flash_stats.op_count[i], flash_stats.op_max[i],
+			flash_stats.op_polls[i] / flash_stats.op_count[i]);
+		printf("  usec histogram:");
+		for (j = 0; j < FLASH_HIST_BINS; j++)
+		{
+			if (flash_stats.op_hist[i][j])
+				printf(" <%lu:%lu", 2UL << j, flash_stats.op_hist[i][j]);
+		}
+		printf("\n");
+	}
+}
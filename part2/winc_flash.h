@@ -21,12 +21,84 @@
 #include <stdbool.h>
 #include "winc_wifi.h"
 
+#define FLASH_SECTOR_SZ     4096    // Erase sector size
+#define FLASH_PAGE_SZ       256     // Program page size
+#define FLASH_STREAM_MAX    16384   // Max chunk size for streamed reads
+
+// Flash layout: the WINC firmware, with its OTA image, fills the first
+// 4 Mbit; on larger parts, the rest is used by this application. The
+// key-value store & event log are at the top of flash
+#define FLASH_USER_BASE     0x80000     // Start of application area
+#define FLASH_USER_MIN      0x100000    // Min flash size with application area
+#define FLASH_OTA_BASE      FLASH_USER_BASE
+#define FLASH_OTA_SIZE      0x40000     // Region for OTA images
+#define FLASH_FTL_BASE      (FLASH_OTA_BASE + FLASH_OTA_SIZE)
+
+// Erase command types, for statistics
+#define FLASH_ERASE_4K      0
+#define FLASH_ERASE_32K     1
+#define FLASH_ERASE_64K     2
+#define FLASH_ERASE_CHIP    3
+#define FLASH_ERASE_TYPES   4
+
+// Timed operation types: erase types as above, and page program
+#define FLASH_OP_PROGRAM    FLASH_ERASE_TYPES
+#define FLASH_OPS           (FLASH_ERASE_TYPES + 1)
+
+#define FLASH_HIST_BINS     24      // Histogram bins, power-of-2 usec
+#define FLASH_POLL_MIN_USEC 20      // Initial status poll interval
+#define FLASH_POLL_MAX_USEC 5000    // Max status poll interval
+#define FLASH_WAKE_USEC     35      // Time to leave deep power-down
+
+// Flash operation statistics
+typedef struct {
+    uint32_t erases, pages_written, pages_skipped;
+    uint32_t read_bytes, read_usec, write_bytes, write_usec;
+    uint32_t erase_count[FLASH_ERASE_TYPES], erase_usec[FLASH_ERASE_TYPES];
+    uint32_t op_count[FLASH_OPS], op_usec[FLASH_OPS], op_polls[FLASH_OPS];
+    uint32_t op_min[FLASH_OPS], op_max[FLASH_OPS];
+    uint32_t op_hist[FLASH_OPS][FLASH_HIST_BINS];
+    uint32_t sleeps, wakes, sleep_usec, wake_usec, wake_max;
+} FLASH_STATS;
+
+extern FLASH_STATS flash_stats;
+
+// Result of a flash update: number of sectors compared, unchanged
+// (skipped), and erased, with the total time taken
+typedef struct {
+    uint32_t sectors, skipped, erased, usec;
+} FLASH_UPDATE_RESULT;
+
+// State of a sector rewrite done in steps
+typedef struct {
+    uint8_t *pu8New, *pu8Old;
+    uint32_t u32Addr, u32Page;
+    uint8_t u8State, u8Erase;
+} FLASH_REWRITE;
+
+#define FLASH_STEP_MORE     1       // Return value if more steps needed
+
+// Handler for streamed flash reads, given address, data & length of
+// each chunk. Return false to stop the transfer
+typedef bool (*FLASH_READ_HANDLER)(void *ctx, uint32_t addr, uint8_t *data, uint32_t len);
+
 // Global functions
 int8_t spi_flash_enable(int fd, uint8_t enable);
 int8_t spi_flash_read(int fd, uint8_t *pu8Buf, uint32_t u32offset, uint32_t u32Sz);
+int8_t spi_flash_read_stream(int fd, uint32_t u32Addr, uint32_t u32Sz, uint8_t *pu8Buf,
+                             uint32_t u32Chunk, FLASH_READ_HANDLER handler, void *ctx);
 int8_t spi_flash_write(int fd, uint8_t* pu8Buf, uint32_t u32Offset, uint32_t u32Sz);
 int8_t spi_flash_erase(int fd, uint32_t u32Offset, uint32_t u32Sz);
 uint32_t spi_flash_get_size(int fd);
+void spi_flash_set_idle(uint32_t u32Msec);
+void spi_flash_idle(int fd);
+void spi_flash_stats_print(void);
+int8_t spi_flash_rewrite_sector(int fd, uint8_t *pu8New, uint8_t *pu8Old, uint32_t u32Addr);
+void spi_flash_rewrite_start(FLASH_REWRITE *pstrRw, uint8_t *pu8New, uint8_t *pu8Old, uint32_t u32Addr);
+int8_t spi_flash_rewrite_step(int fd, FLASH_REWRITE *pstrRw);
+void spi_flash_rewrite_abort(int fd, FLASH_REWRITE *pstrRw);
+int8_t spi_flash_update(int fd, uint8_t *pu8Buf, uint32_t u32Offset, uint32_t u32Sz,
+                        FLASH_UPDATE_RESULT *pstrResult);
 
 // Redefine BSP_MIN to MIN
 #ifndef MIN
@@ -0,0 +1,408 @@
+// Flash translation layer for ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Logical sectors are never rewritten in place; each write goes to the
+// next erased physical sector after the write frontier, and the old copy
+// is marked for erasure, which is done in the background by ftl_task.
+// A sector the host no longer uses is unmapped, and marked for erasure.
+// The new sector is logged as allocated before it is programmed, so if
+// power fails during the write, it is erased again before re-use.
+//
+// The first 2 physical sectors hold the metadata. Each starts with a
+// checkpoint (header, logical-to-physical map, wear counts, sector states)
+// followed by a log of map changes & erasures. When the log is full, a
+// new checkpoint is written to the other sector. At boot, the sector with
+// the latest valid checkpoint is loaded, and its log is replayed. If
+// there is no valid checkpoint, the FTL isn't mounted; formatting is an
+// explicit operation, as it discards all data in the area.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_flash.h"
+#include "winc_ftl.h"
+
+// Offsets within metadata sector
+#define MAP_OSET        sizeof(FTL_HDR)
+#define WEAR_OSET       (MAP_OSET + FTL_MAX_SECTORS*2)
+#define STATE_OSET      (WEAR_OSET + FTL_MAX_SECTORS*2)
+#define CKPT_SIZE       (STATE_OSET + FTL_MAX_SECTORS)
+#define LOG_OSET        ((CKPT_SIZE + 255) & ~255)
+#define LOG_RECS        ((FLASH_SECTOR_SZ - LOG_OSET) / sizeof(FTL_REC))
+
+FTL_STATS ftl_stats;
+uint16_t ftl_map[FTL_MAX_SECTORS], ftl_wear[FTL_MAX_SECTORS];
+uint8_t ftl_state[FTL_MAX_SECTORS];
+uint8_t ckpt_buff[LOG_OSET];
+uint32_t ftl_base, ftl_seq;
+int ftl_fd, ftl_nphys, ftl_nlog, ftl_meta, ftl_nrecs, ftl_frontier;
+bool ftl_mounted;
+extern int verbose;
+
+// Return address of physical sector
+static uint32_t psect_addr(int psect)
+{
+    return(ftl_base + psect*FLASH_SECTOR_SZ);
+}
+
+// Return checksum of map & wear tables
+static uint32_t ftl_check(void)
+{
+    uint32_t sum=FTL_MAGIC;
+    int i;
+
+    for (i=0; i<FTL_MAX_SECTORS; i++)
+        sum = (sum << 1 | sum >> 31) ^ ftl_map[i] ^ ((uint32_t)ftl_wear[i] << 16) ^ ftl_state[i];
+    return(sum);
+}
+
+// Return check value for log record
+static uint16_t rec_check(FTL_REC *rp)
+{
+    return(rp->lsect ^ rp->psect ^ rp->seq ^ 0xa5a5);
+}
+
+// Erase physical sector, and count wear
+static bool ftl_erase(int psect)
+{
+    bool ok = spi_flash_erase(ftl_fd, psect_addr(psect), FLASH_SECTOR_SZ) == M2M_SUCCESS;
+
+    if (ok)
+    {
+        ftl_wear[psect]++;
+        ftl_state[psect] = PS_ERASED;
+    }
+    return(ok);
+}
+
+// Write checkpoint to the other metadata sector
+static bool ftl_checkpoint(void)
+{
+    int meta = ftl_meta ^ 1;
+    FTL_HDR *hp=(FTL_HDR *)ckpt_buff;
+    bool ok;
+
+    ftl_wear[meta]++;
+    memset(ckpt_buff, 0xff, sizeof(ckpt_buff));
+    memcpy(&ckpt_buff[MAP_OSET], ftl_map, sizeof(ftl_map));
+    memcpy(&ckpt_buff[WEAR_OSET], ftl_wear, sizeof(ftl_wear));
+    memcpy(&ckpt_buff[STATE_OSET], ftl_state, sizeof(ftl_state));
+    hp->seq = ftl_seq + 1;
+    hp->nphys = ftl_nphys;
+    hp->nlog = ftl_nlog;
+    hp->check = ftl_check();
+    // Write tables first, header last, so incomplete checkpoint is invalid
+    ok = spi_flash_erase(ftl_fd, psect_addr(meta), FLASH_SECTOR_SZ) == M2M_SUCCESS &&
+         spi_flash_write(ftl_fd, &ckpt_buff[MAP_OSET], psect_addr(meta)+MAP_OSET,
+                         sizeof(ckpt_buff)-MAP_OSET) == M2M_SUCCESS;
+    hp->magic = FTL_MAGIC;
+    ok = ok && spi_flash_write(ftl_fd, ckpt_buff, psect_addr(meta), sizeof(FTL_HDR)) == M2M_SUCCESS;
+    if (ok)
+    {
+        ftl_meta = meta;
+        ftl_seq++;
+        ftl_nrecs = 0;
+        ftl_stats.checkpoints++;
+    }
+    return(ok);
+}
+
+// Return address of log record
+static uint32_t rec_addr(int n)
+{
+    return(psect_addr(ftl_meta) + LOG_OSET + n*sizeof(FTL_REC));
+}
+
+// Append record to metadata log, writing a new checkpoint first if full
+static bool ftl_log(uint16_t lsect, uint16_t psect)
+{
+    FTL_REC rec;
+
+    if (ftl_nrecs>=LOG_RECS && !ftl_checkpoint())
+        return(0);
+    rec.lsect = lsect;
+    rec.psect = psect;
+    rec.seq = ftl_nrecs;
+    rec.check = rec_check(&rec);
+    ftl_nrecs++;
+    return(spi_flash_write(ftl_fd, (uint8_t *)&rec, rec_addr(ftl_nrecs-1),
+                           sizeof(rec)) == M2M_SUCCESS);
+}
+
+// Apply log record to tables
+static void ftl_apply(FTL_REC *rp)
+{
+    uint16_t old;
+
+    if (rp->lsect < ftl_nlog && rp->psect == FTL_UNMAPPED)
+    {
+        if ((old = ftl_map[rp->lsect]) != FTL_UNMAPPED)
+            ftl_state[old] = PS_DIRTY;
+        ftl_map[rp->lsect] = FTL_UNMAPPED;
+        return;
+    }
+    if (rp->psect >= ftl_nphys)
+        return;
+    if (rp->lsect == FTL_REC_ERASED)
+    {
+        ftl_state[rp->psect] = PS_ERASED;
+        ftl_wear[rp->psect]++;
+    }
+    else if (rp->lsect == FTL_REC_ALLOC)
+        ftl_state[rp->psect] = PS_DIRTY;
+    else if (rp->lsect < ftl_nlog)
+    {
+        if ((old = ftl_map[rp->lsect]) != FTL_UNMAPPED)
+            ftl_state[old] = PS_DIRTY;
+        ftl_map[rp->lsect] = rp->psect;
+        ftl_state[rp->psect] = PS_USED;
+    }
+}
+
+// Load checkpoint from metadata sector, return sequence number, 0 if invalid
+static uint32_t ftl_load(int meta)
+{
+    FTL_HDR *hp=(FTL_HDR *)ckpt_buff;
+
+    if (spi_flash_read(ftl_fd, ckpt_buff, psect_addr(meta), sizeof(ckpt_buff)) != M2M_SUCCESS ||
+        hp->magic != FTL_MAGIC || hp->nphys != ftl_nphys || hp->nlog != ftl_nlog)
+        return(0);
+    memcpy(ftl_map, &ckpt_buff[MAP_OSET], sizeof(ftl_map));
+    memcpy(ftl_wear, &ckpt_buff[WEAR_OSET], sizeof(ftl_wear));
+    memcpy(ftl_state, &ckpt_buff[STATE_OSET], sizeof(ftl_state));
+    return(hp->check == ftl_check() ? hp->seq : 0);
+}
+
+// Set up FTL area, return false if too small
+static bool ftl_area(int fd, uint32_t base, uint32_t size)
+{
+    ftl_fd = fd;
+    ftl_base = base;
+    ftl_nphys = MIN(size / FLASH_SECTOR_SZ, FTL_MAX_SECTORS);
+    ftl_nlog = ftl_nphys - FTL_META_SECTORS - FTL_SPARE_SECTORS;
+    ftl_mounted = 0;
+    memset(&ftl_stats, 0, sizeof(ftl_stats));
+    return(ftl_nlog > 0);
+}
+
+// Finish mounting, once tables are loaded
+static bool ftl_mount_done(bool ok)
+{
+    int i;
+
+    for (i=0; i<FTL_META_SECTORS; i++)
+        ftl_state[i] = PS_META;
+    ftl_frontier = FTL_META_SECTORS;
+    ftl_mounted = ok;
+    return(ok);
+}
+
+// Mount FTL on flash area; fails if there is no valid metadata
+bool ftl_init(int fd, uint32_t base, uint32_t size)
+{
+    uint32_t seq0, seq1;
+    FTL_REC recs[32];
+    int i, n;
+    bool ok=1, done=0;
+
+    if (!ftl_area(fd, base, size))
+        return(0);
+    seq0 = ftl_load(0);
+    seq1 = ftl_load(1);
+    ftl_meta = seq1 > seq0 ? 1 : 0;
+    ftl_seq = MAX(seq0, seq1);
+    if (!ftl_seq || ftl_load(ftl_meta) != ftl_seq)
+    {
+        printf("FTL not formatted\n");
+        return(0);
+    }
+    // Replay log
+    for (ftl_nrecs=0; ok && !done && ftl_nrecs<LOG_RECS; )
+    {
+        n = MIN(LOG_RECS - ftl_nrecs, sizeof(recs)/sizeof(FTL_REC));
+        ok = spi_flash_read(fd, (uint8_t *)recs, rec_addr(ftl_nrecs),
+                            n*sizeof(FTL_REC)) == M2M_SUCCESS;
+        for (i=0; ok && i<n && !done; i++)
+        {
+            if (recs[i].seq != (uint16_t)ftl_nrecs || recs[i].check != rec_check(&recs[i]))
+                done = 1;
+            else
+            {
+                ftl_apply(&recs[i]);
+                ftl_nrecs++;
+            }
+        }
+    }
+    // If log ends with a partly-written record, start a fresh one
+    if (ok && ftl_nrecs<LOG_RECS)
+    {
+        ok = spi_flash_read(fd, (uint8_t *)recs, rec_addr(ftl_nrecs),
+                            sizeof(FTL_REC)) == M2M_SUCCESS;
+        for (i=0; ok && i<sizeof(FTL_REC); i++)
+        {
+            if (((uint8_t *)recs)[i] != 0xff)
+            {
+                ok = ftl_checkpoint();
+                break;
+            }
+        }
+    }
+    if (verbose)
+        printf("FTL %s seq %lu, %d log records\n", ok ? "mounted" : "failed", ftl_seq, ftl_nrecs);
+    return(ftl_mount_done(ok));
+}
+
+// Format FTL area, discarding all data: empty map, and all data sectors
+// marked for erasure by ftl_task
+bool ftl_format(int fd, uint32_t base, uint32_t size)
+{
+    bool ok;
+
+    if (!ftl_area(fd, base, size))
+        return(0);
+    printf("FTL format %d sectors\n", ftl_nlog);
+    memset(ftl_map, 0xff, sizeof(ftl_map));
+    memset(ftl_wear, 0, sizeof(ftl_wear));
+    memset(ftl_state, PS_DIRTY, sizeof(ftl_state));
+    ftl_meta = 1;
+    ftl_seq = 0;
+    ok = ftl_checkpoint();
+    return(ftl_mount_done(ok));
+}
+
+// Return number of logical sectors
+uint32_t ftl_sectors(void)
+{
+    return(ftl_mounted ? ftl_nlog : 0);
+}
+
+// Read logical sector; an unmapped sector reads as erased
+bool ftl_read(uint32_t lsect, uint8_t *buff)
+{
+    uint16_t psect = ftl_mounted && lsect<ftl_nlog ? ftl_map[lsect] : FTL_UNMAPPED;
+
+    if (psect == FTL_UNMAPPED)
+    {
+        memset(buff, 0xff, FLASH_SECTOR_SZ);
+        return(ftl_mounted && lsect<ftl_nlog);
+    }
+    return(spi_flash_read(ftl_fd, buff, psect_addr(psect), FLASH_SECTOR_SZ) == M2M_SUCCESS);
+}
+
+// Return next erased sector after the write frontier; if there are none,
+// erase the dirty sector with least wear. Return -ve if error
+static int ftl_alloc(void)
+{
+    int i, p, best=-1;
+
+    for (i=0; i<ftl_nphys; i++)
+    {
+        p = (ftl_frontier + i) % ftl_nphys;
+        if (ftl_state[p] == PS_ERASED)
+            return(ftl_frontier = p);
+        if (ftl_state[p]==PS_DIRTY && (best<0 || ftl_wear[p]<ftl_wear[best]))
+            best = p;
+    }
+    if (best<0 || !ftl_erase(best) || !ftl_log(FTL_REC_ERASED, best))
+        return(-1);
+    ftl_stats.fg_erases++;
+    return(ftl_frontier = best);
+}
+
+// Write logical sector to a fresh physical sector, skipping blank pages
+// The sector is logged as allocated first, so it isn't re-used as erased
+// if the write is interrupted
+bool ftl_write(uint32_t lsect, uint8_t *buff)
+{
+    int psect, i, j;
+    bool ok, blank;
+
+    if (!ftl_mounted || lsect>=ftl_nlog || (psect = ftl_alloc()) < 0)
+        return(0);
+    ftl_state[psect] = PS_DIRTY;
+    ok = ftl_log(FTL_REC_ALLOC, psect);
+    for (i=0; ok && i<FLASH_SECTOR_SZ; i+=FLASH_PAGE_SZ)
+    {
+        for (j=i, blank=1; blank && j<i+FLASH_PAGE_SZ; j++)
+            blank = buff[j] == 0xff;
+        if (!blank)
+            ok = spi_flash_write(ftl_fd, &buff[i], psect_addr(psect)+i, FLASH_PAGE_SZ) == M2M_SUCCESS;
+    }
+    ok = ok && ftl_log(lsect, psect);
+    if (ok)
+    {
+        FTL_REC rec = {lsect, psect};
+        ftl_apply(&rec);
+        ftl_stats.writes++;
+    }
+    return(ok);
+}
+
+// Unmap logical sector that is no longer in use, so its physical sector
+// can be erased; it then reads as erased
+bool ftl_unmap(uint32_t lsect)
+{
+    FTL_REC rec = {lsect, FTL_UNMAPPED};
+
+    if (!ftl_mounted || lsect>=ftl_nlog)
+        return(0);
+    if (ftl_map[lsect] == FTL_UNMAPPED)
+        return(1);
+    if (!ftl_log(lsect, FTL_UNMAPPED))
+        return(0);
+    ftl_apply(&rec);
+    ftl_stats.unmaps++;
+    return(1);
+}
+
+// Background garbage collection: erase one dirty sector, least-worn first
+// Return non-zero if more work remains
+bool ftl_task(void)
+{
+    int i, best=-1;
+
+    if (!ftl_mounted)
+        return(0);
+    for (i=FTL_META_SECTORS; i<ftl_nphys; i++)
+    {
+        if (ftl_state[i]==PS_DIRTY && (best<0 || ftl_wear[i]<ftl_wear[best]))
+            best = i;
+    }
+    if (best>=0 && ftl_erase(best) && ftl_log(FTL_REC_ERASED, best))
+        ftl_stats.gc_erases++;
+    return(best >= 0);
+}
+
+// Display FTL statistics
+void ftl_stats_print(void)
+{
+    int i, nerased=0, ndirty=0;
+    uint16_t wmin=0xffff, wmax=0;
+
+    for (i=FTL_META_SECTORS; i<ftl_nphys; i++)
+    {
+        nerased += ftl_state[i] == PS_ERASED;
+        ndirty += ftl_state[i] == PS_DIRTY;
+        wmin = MIN(wmin, ftl_wear[i]);
+        wmax = MAX(wmax, ftl_wear[i]);
+    }
+    printf("FTL writes %lu unmaps %lu erases fg %lu gc %lu, checkpoints %lu, erased %d dirty %d, wear %u-%u\n",
+           ftl_stats.writes, ftl_stats.unmaps, ftl_stats.fg_erases, ftl_stats.gc_erases,
+           ftl_stats.checkpoints, nerased, ndirty, wmin, wmax);
+}
+
+// EOF
@@ -0,0 +1,68 @@
+#ifndef __WINC_FTL_H__
+#define __WINC_FTL_H__
+
+// Flash translation layer for ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FTL_MAX_SECTORS     256     // Max physical sectors (1 MB flash)
+#define FTL_META_SECTORS    2       // Sectors for map checkpoint & log
+#define FTL_SPARE_SECTORS   6       // Physical sectors not visible to host
+#define FTL_MAGIC           0x314c5446  // "FTL1"
+#define FTL_UNMAPPED        0xffff
+#define FTL_REC_ERASED      0xfffe  // Log record: physical sector erased
+#define FTL_REC_ALLOC       0xfffd  // Log record: physical sector being written
+                                    // Log record with physical FTL_UNMAPPED:
+                                    // logical sector no longer in use
+
+// Physical sector states
+#define PS_DIRTY            0       // Stale data, needs erase
+#define PS_ERASED           1
+#define PS_USED             2
+#define PS_META             3
+
+// Checkpoint header, at start of metadata sector
+typedef struct {
+    uint32_t magic, seq;
+    uint16_t nphys, nlog;
+    uint32_t check;
+} FTL_HDR;
+
+// Log record, appended to metadata sector after checkpoint
+typedef struct {
+    uint16_t lsect, psect, seq, check;
+} FTL_REC;
+
+// FTL statistics
+typedef struct {
+    uint32_t writes, unmaps, fg_erases, gc_erases, checkpoints;
+} FTL_STATS;
+
+extern FTL_STATS ftl_stats;
+
+bool ftl_init(int fd, uint32_t base, uint32_t size);
+bool ftl_format(int fd, uint32_t base, uint32_t size);
+uint32_t ftl_sectors(void);
+bool ftl_read(uint32_t lsect, uint8_t *buff);
+bool ftl_write(uint32_t lsect, uint8_t *buff);
+bool ftl_unmap(uint32_t lsect);
+bool ftl_task(void);
+void ftl_stats_print(void);
+
+#endif
+// EOF
@@ -0,0 +1,414 @@
+// HTTP file server for the ATWINC1500/1510 & Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Files are served from the FAT filesystem on the MSC disk. Each
+// connection keeps HTTP_TX_QUEUE sends in progress; when the chip reports
+// a send is complete, the next block is read from the disk cache & sent,
+// so flash reads overlap with transmission. The response header shares
+// the first send with the start of the file data. Requests that arrive
+// while a response is being sent are queued, and handled in turn.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_sock.h"
+#include "winc_flash.h"
+#include "winc_fat.h"
+#include "winc_http.h"
+
+HTTP_STATS http_stats;
+HTTP_CONN http_conns[MAX_TCP_SOCK];
+char http_txbuff[HTTP_TX_CHUNK], http_hdrs[HTTP_REQ_MAX+1];
+extern int verbose;
+
+// Return text for HTTP status code
+static char *status_str(int status)
+{
+    return(status==200 ? "OK" : status==206 ? "Partial Content" :
+           status==400 ? "Bad Request" : status==404 ? "Not Found" :
+           status==414 ? "URI Too Long" : status==416 ? "Range Not Satisfiable" :
+           status==431 ? "Request Header Fields Too Large" : "Not Implemented");
+}
+
+// Return MIME type for file name
+static char *mime_type(char *path)
+{
+    char *ext = strrchr(path, '.');
+
+    if (!ext)
+        return("application/octet-stream");
+    ext++;
+    return(!strcasecmp(ext, "htm") || !strcasecmp(ext, "html") ? "text/html" :
+           !strcasecmp(ext, "txt") ? "text/plain" :
+           !strcasecmp(ext, "css") ? "text/css" :
+           !strcasecmp(ext, "js") ? "application/javascript" :
+           !strcasecmp(ext, "json") ? "application/json" :
+           !strcasecmp(ext, "png") ? "image/png" :
+           !strcasecmp(ext, "jpg") || !strcasecmp(ext, "jpeg") ? "image/jpeg" :
+           !strcasecmp(ext, "gif") ? "image/gif" :
+           !strcasecmp(ext, "ico") ? "image/x-icon" : "application/octet-stream");
+}
+
+// Return value of request header, or null if not present
+static char *http_header(char *hdrs, char *name)
+{
+    int len = strlen(name);
+    char *p = hdrs;
+
+    while ((p = strstr(p, "\r\n")) != NULL)
+    {
+        p += 2;
+        if (!strncasecmp(p, name, len) && p[len]==':')
+        {
+            for (p+=len+1; *p==' '; p++) ;
+            return(p);
+        }
+    }
+    return(NULL);
+}
+
+// Decode %xx escapes in URL path
+static void url_decode(char *s)
+{
+    char *d=s, hex[3]={0};
+
+    while (*s)
+    {
+        if (s[0]=='%' && isxdigit((int)s[1]) && isxdigit((int)s[2]))
+        {
+            hex[0] = s[1];
+            hex[1] = s[2];
+            *d++ = (char)strtoul(hex, NULL, 16);
+            s += 3;
+        }
+        else
+            *d++ = *s++;
+    }
+    *d = 0;
+}
+
+// Get byte range from header value; return 1 if OK, 0 if not satisfiable,
+// -1 if not understood (multiple ranges are not supported, so are ignored)
+static int http_range(char *p, uint32_t size, uint32_t *firstp, uint32_t *lastp)
+{
+    uint32_t first, last=size-1;
+    char *e;
+
+    if (strncasecmp(p, "bytes=", 6) || strchr(p, ','))
+        return(-1);
+    p += 6;
+    if (*p == '-')
+    {
+        first = strtoul(p+1, &e, 10);
+        if (e == p+1)
+            return(-1);
+        if (first==0 || size==0)
+            return(0);
+        first = first > size ? 0 : size - first;
+    }
+    else
+    {
+        first = strtoul(p, &e, 10);
+        if (e==p || *e!='-')
+            return(-1);
+        p = e + 1;
+        if (isdigit((int)*p))
+        {
+            last = strtoul(p, NULL, 10);
+            if (last < first)
+                return(-1);
+        }
+        if (first >= size)
+            return(0);
+        last = MIN(last, size-1);
+    }
+    *firstp = first;
+    *lastp = last;
+    return(1);
+}
+
+// Clear connection state, closing socket if still open
+static void http_close(int fd, uint8_t sock)
+{
+    HTTP_CONN *cp = &http_conns[sock];
+
+    if (cp->handle && sock_from_handle(cp->handle) >= 0)
+        put_sock_close(fd, sock);
+    memset(cp, 0, sizeof(HTTP_CONN));
+}
+
+// Send header (already in Tx buffer) & file data, until queue is full
+static bool http_fill(int fd, uint8_t sock, HTTP_CONN *cp, int oset)
+{
+    int n;
+
+    while ((oset>0 || cp->pos<cp->end) && cp->queued<HTTP_TX_QUEUE)
+    {
+        n = MIN((uint32_t)(HTTP_TX_CHUNK - oset), cp->end - cp->pos);
+        if (n>0 && (n = fat_read(&cp->file, cp->pos, &http_txbuff[oset], n)) <= 0)
+            return(false);
+        if (!put_sock_send(fd, sock, http_txbuff, oset+n))
+            return(false);
+        cp->queued++;
+        cp->pos += n;
+        cp->bytes += n;
+        oset = 0;
+    }
+    return(true);
+}
+
+// Start sending response, given header length
+static void http_send(int fd, uint8_t sock, HTTP_CONN *cp, int hlen)
+{
+    cp->sending = true;
+    if (!http_fill(fd, sock, cp, hlen))
+        http_close(fd, sock);
+}
+
+// Send error response
+static void http_error(int fd, uint8_t sock, HTTP_CONN *cp, int status, char *extra)
+{
+    char body[48];
+    int blen, hlen;
+
+    blen = snprintf(body, sizeof(body), "%d %s\n", status, status_str(status));
+    hlen = snprintf(http_txbuff, HTTP_TX_CHUNK, "HTTP/1.1 %d %s\r\n"
+                    "Content-Type: text/plain\r\nContent-Length: %d\r\n%sConnection: %s\r\n\r\n%s",
+                    status, status_str(status), blen, extra ? extra : "",
+                    cp->keepalive ? "keep-alive" : "close", body);
+    cp->status = status;
+    cp->pos = cp->end = 0;
+    http_stats.errors++;
+    if (verbose)
+        printf("HTTP sock %u error %d\n", sock, status);
+    http_send(fd, sock, cp, hlen);
+}
+
+// Handle request, given the headers
+static void http_request(int fd, uint8_t sock, HTTP_CONN *cp, char *hdrs)
+{
+    char *method=hdrs, *path, *ver, *p, fpath[HTTP_PATH_MAX + sizeof(HTTP_INDEX) + 1];
+    char extra[48]="";
+    uint32_t size, first=0, last=0;
+    int hlen, n;
+    bool head, ok;
+
+    cp->start = usec();
+    cp->bytes = 0;
+    http_stats.requests++;
+    if ((path = strchr(hdrs, ' ')) == NULL || (ver = strchr(path+1, ' ')) == NULL)
+    {
+        cp->keepalive = false;
+        http_error(fd, sock, cp, 400, NULL);
+        return;
+    }
+    *path++ = *ver++ = 0;
+    cp->keepalive = !strncmp(ver, "HTTP/1.1", 8);
+    if ((p = http_header(ver, "Connection")) != NULL)
+        cp->keepalive = !strncasecmp(p, "close", 5) ? false :
+                        !strncasecmp(p, "keep-alive", 10) ? true : cp->keepalive;
+    if ((p = strchr(path, '?')) != NULL)
+        *p = 0;
+    url_decode(path);
+    if (verbose)
+        printf("HTTP sock %u %s %s\n", sock, method, path);
+    head = !strcmp(method, "HEAD");
+    if (!head && strcmp(method, "GET"))
+    {
+        http_error(fd, sock, cp, 501, NULL);
+        return;
+    }
+    if ((n = strlen(path)) > HTTP_PATH_MAX)
+    {
+        http_error(fd, sock, cp, 414, NULL);
+        return;
+    }
+    strcpy(fpath, path);
+    ok = fat_open(fpath, &cp->file);
+    if (ok && cp->file.dir)
+    {
+        strcpy(&fpath[n], n>0 && fpath[n-1]=='/' ? HTTP_INDEX : "/" HTTP_INDEX);
+        ok = fat_open(fpath, &cp->file);
+    }
+    if (!ok || cp->file.dir)
+    {
+        http_error(fd, sock, cp, 404, NULL);
+        return;
+    }
+    size = cp->file.size;
+    cp->status = 200;
+    if ((p = http_header(ver, "Range")) != NULL &&
+        (n = http_range(p, size, &first, &last)) >= 0)
+    {
+        if (n == 0)
+        {
+            snprintf(extra, sizeof(extra), "Content-Range: bytes */%lu\r\n", size);
+            http_error(fd, sock, cp, 416, extra);
+            return;
+        }
+        cp->status = 206;
+        snprintf(extra, sizeof(extra), "Content-Range: bytes %lu-%lu/%lu\r\n", first, last, size);
+    }
+    else if (size > 0)
+        last = size - 1;
+    cp->pos = first;
+    cp->end = size && !head ? last + 1 : first;
+    hlen = snprintf(http_txbuff, HTTP_TX_CHUNK, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+                    "Content-Length: %lu\r\nAccept-Ranges: bytes\r\n%sConnection: %s\r\n\r\n",
+                    cp->status, status_str(cp->status), mime_type(fpath),
+                    size ? last - first + 1 : 0, extra, cp->keepalive ? "keep-alive" : "close");
+    http_send(fd, sock, cp, hlen);
+}
+
+// Handle next request in buffer, if complete
+static void http_next(int fd, uint8_t sock, HTTP_CONN *cp)
+{
+    char *end = strstr(cp->req, "\r\n\r\n");
+    int hlen;
+
+    if (end == NULL)
+    {
+        if (cp->req_len >= HTTP_REQ_MAX)
+        {
+            cp->req_len = 0;
+            cp->keepalive = false;
+            http_error(fd, sock, cp, 431, NULL);
+        }
+        return;
+    }
+    hlen = end + 4 - cp->req;
+    memcpy(http_hdrs, cp->req, hlen - 2);
+    http_hdrs[hlen - 2] = 0;
+    cp->req_len -= hlen;
+    memmove(cp->req, &cp->req[hlen], cp->req_len + 1);
+    http_request(fd, sock, cp, http_hdrs);
+}
+
+// Response complete: update stats, and close or handle next request
+static void http_done(int fd, uint8_t sock, HTTP_CONN *cp)
+{
+    uint32_t dt = usec() - cp->start;
+
+    if (verbose)
+        printf("HTTP sock %u status %d, %lu bytes, %lu ms\n", sock, cp->status, cp->bytes, dt/1000);
+    http_stats.bytes += cp->bytes;
+    if (cp->bytes >= HTTP_LARGE_FILE)
+    {
+        http_stats.large_files++;
+        http_stats.large_bytes += cp->bytes;
+        http_stats.large_usec += dt;
+    }
+    cp->sending = false;
+    if (!cp->keepalive)
+        http_close(fd, sock);
+    else
+        http_next(fd, sock, cp);
+}
+
+// Open HTTP server socket, return socket number (-ve if error)
+int http_server_init(int portnum)
+{
+    int sock = open_sock_server(portnum, 1, http_handler);
+
+    sock_set_sent_handler(sock, http_sent_handler);
+    return(sock);
+}
+
+// Handler for HTTP socket: add incoming data to request buffer
+void http_handler(int fd, uint8_t sock, int rxlen)
+{
+    HTTP_CONN *cp;
+
+    if (sock >= MAX_TCP_SOCK)
+        return;
+    cp = &http_conns[sock];
+    if (cp->handle != sock_handle(sock))
+    {
+        memset(cp, 0, sizeof(HTTP_CONN));
+        cp->handle = sock_handle(sock);
+    }
+    if (rxlen <= 0)
+    {
+        if (verbose)
+            printf("HTTP sock %u %s\n", sock, sock_err_str(rxlen));
+        http_close(fd, sock);
+        return;
+    }
+    // Data that doesn't fit in the buffer would be lost, so reject the
+    // request, or close after the current response if one is being sent
+    if (rxlen > HTTP_REQ_MAX - cp->req_len)
+    {
+        cp->req_len = 0;
+        cp->req[0] = 0;
+        cp->keepalive = false;
+        if (!cp->sending)
+            http_error(fd, sock, cp, 431, NULL);
+        return;
+    }
+    if (get_sock_data(fd, sock, &cp->req[cp->req_len], rxlen))
+        cp->req_len += rxlen;
+    cp->req[cp->req_len] = 0;
+    if (!cp->sending)
+        http_next(fd, sock, cp);
+}
+
+// Handler for send completion: send more data, or finish response
+void http_sent_handler(int fd, uint8_t sock, int sent)
+{
+    HTTP_CONN *cp;
+
+    if (sock >= MAX_TCP_SOCK)
+        return;
+    cp = &http_conns[sock];
+    if (cp->handle!=sock_handle(sock) || !cp->sending)
+        return;
+    if (sent < 0)
+    {
+        http_close(fd, sock);
+        return;
+    }
+    if (cp->queued > 0)
+        cp->queued--;
+    if (!http_fill(fd, sock, cp, 0))
+        http_close(fd, sock);
+    else if (cp->queued==0 && cp->pos>=cp->end)
+        http_done(fd, sock, cp);
+}
+
+// Display request rate since last call, and throughput for large files
+void http_stats_print(void)
+{
+    static uint32_t last_usec, last_reqs;
+    uint32_t t=usec(), dt=(t-last_usec)/1000, n=http_stats.requests-last_reqs;
+    uint32_t rate=http_stats.large_usec ? (uint32_t)(http_stats.large_bytes*100ULL/http_stats.large_usec) : 0;
+
+    if (n)
+    {
+        printf("HTTP %lu requests (%lu/s), errors %lu, %lu KB sent; "
+               "%lu large files at %lu.%02lu MB/s\n", http_stats.requests,
+               dt ? n*1000/dt : n, http_stats.errors, http_stats.bytes/1024,
+               http_stats.large_files, rate/100, rate%100);
+    }
+    last_usec = t;
+    last_reqs = http_stats.requests;
+}
+
+// EOF
@@ -0,0 +1,52 @@
+#ifndef __WINC_HTTP_H__
+#define __WINC_HTTP_H__
+
+// HTTP file server for the ATWINC1500/1510 & Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define HTTP_PORTNUM    80
+#define HTTP_REQ_MAX    512         // Max size of request headers
+#define HTTP_PATH_MAX   128         // Max length of file path
+#define HTTP_TX_CHUNK   1400        // Max data in one TCP send
+#define HTTP_TX_QUEUE   2           // Sends in progress per connection
+#define HTTP_INDEX      "index.html"
+#define HTTP_LARGE_FILE 65536       // Min size for file throughput stats
+
+// Connection state
+typedef struct {
+    SOCK_HANDLE handle;
+    FAT_FILE file;
+    uint32_t pos, end, start, bytes;
+    int req_len, queued, status;
+    bool sending, keepalive;
+    char req[HTTP_REQ_MAX+1];
+} HTTP_CONN;
+
+// Server statistics
+typedef struct {
+    uint32_t requests, errors, bytes;
+    uint32_t large_files, large_bytes, large_usec;
+} HTTP_STATS;
+
+extern HTTP_STATS http_stats;
+
+int http_server_init(int portnum);
+void http_handler(int fd, uint8_t sock, int rxlen);
+void http_sent_handler(int fd, uint8_t sock, int sent);
+void http_stats_print(void);
+
+#endif
+// EOF
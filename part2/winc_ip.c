@@ -0,0 +1,208 @@
+// ATWINC1500/1510 IP address configuration for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// With a static or cached address, DHCP is disabled in the chip, and the
+// address is set as soon as the link is up, so sockets can be bound
+// without waiting for a DHCP exchange.
+//
+// The chip's DHCP client can't be asked for a specific address, so the
+// cache mode re-uses the last lease as a static address, without renewing
+// it with the server. This is only safe on a network where the server
+// keeps the address for this device. The age of the lease is kept in the
+// key-value store, so survives a reboot; when it reaches half the lease
+// time (the DHCP renewal point), the cache is dropped, and the network
+// rejoined using DHCP. There is no real-time clock, so time powered down
+// isn't counted; after a long power-down, the address may have been given
+// to another host.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_sock.h"
+#include "winc_flash.h"
+#include "winc_kv.h"
+#include "winc_log.h"
+#include "winc_ip.h"
+
+IP_STATS ip_stats;
+IP_LEASE ip_lease;
+char *ip_ssid;
+bool ip_fixed, ip_up, ip_ready, ip_first;
+uint32_t ip_link_usec, ip_ticks;
+
+// Enable or disable the chip's DHCP client (takes effect on next join)
+static bool ip_dhcp_enable(int fd, bool on)
+{
+    uint32_t dummy=0;
+
+    return(hif_put(fd, on ? GOP_DHCP_ENABLE : GOP_DHCP_DISABLE, &dummy, sizeof(dummy), 0, 0, 0));
+}
+
+// Save new DHCP lease in key-value store, if its lease time is known
+static void ip_lease_save(DHCP_RESP_MSG *dp)
+{
+    if (IP_MODE!=IP_MODE_CACHE || dp->lease<IP_LEASE_MIN)
+        return;
+    memset(&ip_lease, 0, sizeof(ip_lease));
+    strncpy(ip_lease.ssid, ip_ssid, sizeof(ip_lease.ssid)-1);
+    memcpy(&ip_lease.dhcp, dp, sizeof(DHCP_RESP_MSG));
+    kv_set(IP_KV_KEY, &ip_lease, sizeof(ip_lease));
+}
+
+// Return true if cached lease can be used; a lease without a
+// received lease time is never re-used
+static bool ip_lease_ok(void)
+{
+    return(ip_lease.dhcp.self && ip_lease.dhcp.lease >= IP_LEASE_MIN &&
+           ip_lease.age < ip_lease.dhcp.lease/2 && !strcmp(ip_lease.ssid, ip_ssid));
+}
+
+// Drop cached lease; if in use, rejoin network using DHCP
+static void ip_renew(int fd)
+{
+    printf("IP cached lease dropped\n");
+    kv_delete(IP_KV_KEY);
+    memset(&ip_lease, 0, sizeof(ip_lease));
+    if (ip_fixed)
+    {
+        ip_fixed = false;
+        ip_dhcp_enable(fd, true);
+        if (ip_up)
+            leave_net(fd);
+    }
+}
+
+// Set up address mode before joining network
+bool ip_init(int fd, char *ssid)
+{
+    DHCP_RESP_MSG fixed = {IP_STATIC_ADDR, IP_STATIC_GATE, IP_STATIC_DNS, IP_STATIC_MASK, 0};
+
+    ip_ssid = ssid;
+    if (IP_MODE == IP_MODE_STATIC)
+    {
+        memcpy(&ip_lease.dhcp, &fixed, sizeof(fixed));
+        ip_fixed = true;
+    }
+    else if (IP_MODE == IP_MODE_CACHE)
+    {
+        if (kv_get(IP_KV_KEY, &ip_lease, sizeof(ip_lease)) != sizeof(ip_lease))
+            memset(&ip_lease, 0, sizeof(ip_lease));
+        ip_fixed = ip_lease_ok();
+    }
+    return(ip_dhcp_enable(fd, !ip_fixed));
+}
+
+// Handle link state change, DHCP configuration & address conflict;
+// return true if the address is now known, so sockets can be bound
+// On link down, switch to the cached lease (if any) before rejoining
+bool ip_event(int fd, uint16_t gop, RESP_MSG *rmp)
+{
+    uint32_t msec = (usec() - ip_link_usec) / 1000;
+
+    if (gop == GOP_STATE_CHANGE)
+    {
+        ip_up = rmp->data[0] == 1;
+        ip_ready = ip_first = false;
+        if (ip_up)
+        {
+            ip_link_usec = usec();
+            ip_stats.links++;
+            if (ip_fixed)
+            {
+                printf("IP %u.%u.%u.%u %s\n", IP_BYTES(ip_lease.dhcp.self),
+                       IP_MODE==IP_MODE_STATIC ? "static" : "from cached lease");
+                ip_stats.fixed++;
+                ip_ready = hif_put(fd, GOP_STATIC_IP, &ip_lease.dhcp, sizeof(DHCP_RESP_MSG), 0, 0, 0);
+                log_event(LOG_DHCP, &ip_lease.dhcp.self, sizeof(ip_lease.dhcp.self));
+                return(ip_ready);
+            }
+        }
+        else if (IP_MODE==IP_MODE_CACHE && !ip_fixed && ip_lease_ok())
+        {
+            ip_fixed = true;
+            ip_dhcp_enable(fd, false);
+        }
+    }
+    else if (gop == GOP_DHCP_CONF)
+    {
+        if (ip_up && !ip_ready)
+        {
+            ip_stats.dhcp++;
+            ip_stats.dhcp_msec += msec;
+            printf("IP from DHCP in %lu ms, lease %lu sec\n", msec, rmp->dhcp.lease);
+            ip_ready = true;
+        }
+        // A lease time of zero means it wasn't in the response
+        if (!rmp->dhcp.lease)
+        {
+            ip_stats.no_lease++;
+            printf("IP DHCP response without lease time\n");
+        }
+        ip_lease_save(&rmp->dhcp);
+        return(true);
+    }
+    else if (gop == GOP_IP_CONFLICT)
+    {
+        printf("IP address conflict\n");
+        if (IP_MODE == IP_MODE_CACHE)
+            ip_renew(fd);
+    }
+    return(false);
+}
+
+// Note that a client has been served (connection accepted, or datagram
+// received); the first after link up gives the time to first packet
+void ip_served(void)
+{
+    uint32_t msec = (usec() - ip_link_usec) / 1000;
+
+    if (ip_up && !ip_first)
+    {
+        ip_first = true;
+        ip_stats.served++;
+        ip_stats.served_msec += msec;
+        ip_stats.last_msec = msec;
+        printf("IP first packet %lu ms after link up\n", msec);
+    }
+}
+
+// Update age of cached lease, saving it periodically, and drop the lease
+// when it is due for renewal (call regularly from main loop)
+void ip_poll(int fd)
+{
+    if (!ip_ticks)
+        ustimeout(&ip_ticks, 0);
+    if (!ustimeout(&ip_ticks, 1000000) || IP_MODE!=IP_MODE_CACHE || !ip_lease.dhcp.self)
+        return;
+    if (++ip_lease.age >= ip_lease.dhcp.lease/2)
+        ip_renew(fd);
+    else if (ip_lease.age % IP_LEASE_SAVE == 0)
+        kv_set(IP_KV_KEY, &ip_lease, sizeof(ip_lease));
+}
+
+// Display address statistics
+void ip_stats_print(void)
+{
+    IP_STATS *is = &ip_stats;
+
+    printf("IP links %lu, fixed %lu, DHCP %lu avg %lu ms (%lu without lease), first packet %lu avg %lu ms\n",
+           is->links, is->fixed, is->dhcp, is->dhcp ? is->dhcp_msec/is->dhcp : 0, is->no_lease,
+           is->served, is->served ? is->served_msec/is->served : 0);
+}
+
+// EOF
@@ -0,0 +1,62 @@
+#ifndef __WINC_IP_H__
+#define __WINC_IP_H__
+
+// ATWINC1500/1510 IP address configuration for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define IP_MODE_DHCP    0           // Address from DHCP on every join
+#define IP_MODE_CACHE   1           // Re-use last DHCP lease without renewing it
+#define IP_MODE_STATIC  2           // Fixed address, no DHCP
+
+#define IP_MODE         IP_MODE_DHCP
+
+// Make address in network byte order
+#define IP_ADDR(a, b, c, d) ((a) | (b)<<8 | (c)<<16 | (uint32_t)(d)<<24)
+
+// Static address settings
+#define IP_STATIC_ADDR  IP_ADDR(192,168,1,200)
+#define IP_STATIC_GATE  IP_ADDR(192,168,1,1)
+#define IP_STATIC_DNS   IP_ADDR(192,168,1,1)
+#define IP_STATIC_MASK  IP_ADDR(255,255,255,0)
+
+#define IP_LEASE_MIN    300         // Don't cache leases shorter than this (sec)
+#define IP_LEASE_SAVE   300         // Interval for saving lease age (sec)
+#define IP_KV_KEY       "dhcp_lease"    // Key-value store entry for DHCP lease
+
+// DHCP lease, kept in key-value store, with the time since it was
+// obtained (in seconds, only counting while powered up)
+typedef struct {
+    char ssid[33];
+    DHCP_RESP_MSG dhcp;
+    uint32_t age;
+} IP_LEASE;
+
+// Address statistics; times in msec from link up
+typedef struct {
+    uint32_t links, fixed, dhcp, no_lease, served;
+    uint32_t dhcp_msec, served_msec, last_msec;
+} IP_STATS;
+
+extern IP_STATS ip_stats;
+
+bool ip_init(int fd, char *ssid);
+bool ip_event(int fd, uint16_t gop, RESP_MSG *rmp);
+void ip_served(void);
+void ip_poll(int fd);
+void ip_stats_print(void);
+
+#endif
+// EOF
@@ -0,0 +1,236 @@
+// ATWINC1500/1510 WiFi network join for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// After a successful join, the channel & BSSID of the AP are fetched from
+// the chip, and saved in the key-value store. The next join (after boot,
+// or loss of the link) goes straight to that AP on that channel, avoiding
+// a scan of all channels; if it fails or times out, a full scan is used.
+//
+// If the link is lost, connections are closed, and server sockets are
+// bound again once the link is back up. Failed joins are retried after a
+// delay that doubles each time (up to a limit), with random jitter so
+// that devices sharing an AP don't all retry at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_sock.h"
+#include "winc_flash.h"
+#include "winc_kv.h"
+#include "winc_log.h"
+#include "winc_join.h"
+
+JOIN_STATS join_stats;
+JOIN_CACHE join_cache;
+char *join_ssid, *join_pass;
+int join_state;
+bool join_cached, join_save;
+uint32_t join_usec, join_abort_usec, join_down_usec, join_retry_msec, join_ticks;
+int join_backoff;
+bool join_lost;
+extern int verbose;
+
+// Start a join attempt, targeted or with full scan
+static bool join_attempt(int fd, bool fast)
+{
+    uint8_t *b = join_cache.bssid;
+
+    join_usec = usec();
+    join_state = fast ? JOIN_FAST : JOIN_SCAN;
+    if (fast)
+    {
+        join_stats.fast++;
+        printf("Join %s ch %u AP %02X:%02X:%02X:%02X:%02X:%02X\n", join_ssid,
+               join_cache.chan, b[0], b[1], b[2], b[3], b[4], b[5]);
+        return(join_net_chan(fd, join_ssid, join_pass, join_cache.chan, b));
+    }
+    join_stats.scans++;
+    printf("Join %s with scan\n", join_ssid);
+    return(join_net(fd, join_ssid, join_pass));
+}
+
+// Wait before retrying join, with jittered exponential backoff
+static void join_wait(void)
+{
+    uint32_t delay = MIN(JOIN_RETRY_MSEC << MIN(join_backoff, 8), JOIN_BACKOFF_MAX_MSEC);
+
+    join_retry_msec = delay/2 + rand() % (delay/2 + 1);
+    join_backoff++;
+    join_state = JOIN_DOWN;
+    join_usec = usec();
+    printf("Join retry in %lu ms\n", join_retry_msec);
+}
+
+// Abandon a join attempt that has taken too long
+static void join_abort(int fd)
+{
+    join_abort_usec = usec();
+    leave_net(fd);
+}
+
+// Start joining network (strings must be kept); use targeted join
+// if the AP for this SSID is known, otherwise full scan
+bool join_start(int fd, char *ssid, char *pass)
+{
+    uint32_t seed = usec();
+    int i;
+
+    join_ssid = ssid;
+    join_pass = pass;
+    // Boot timing is much the same on every unit, so include the MAC
+    // address, to spread out retries after a common power failure
+    for (i=0; i<sizeof(chip_mac); i++)
+        seed = seed*31 + chip_mac[i];
+    srand(seed);
+    join_cached = kv_get(JOIN_KV_KEY, &join_cache, sizeof(join_cache)) == sizeof(join_cache) &&
+                  !strcmp(join_cache.ssid, ssid) && join_cache.chan>=1 && join_cache.chan<=14;
+    return(join_attempt(fd, join_cached));
+}
+
+// Handle connection state change & connection info
+void join_event(int fd, uint16_t gop, RESP_MSG *rmp)
+{
+    CONN_INFO_RESP_MSG *cp = &rmp->conn_info;
+    uint32_t msec = (usec() - join_usec) / 1000;
+    bool up = rmp->data[0] == 1;
+    int n;
+
+    if (gop==GOP_STATE_CHANGE && up && (join_state==JOIN_FAST || join_state==JOIN_SCAN))
+    {
+        join_stats.last_msec = msec;
+        if (join_state == JOIN_FAST)
+        {
+            join_stats.fast_ok++;
+            join_stats.fast_msec += msec;
+        }
+        else
+        {
+            join_stats.scan_ok++;
+            join_stats.scan_msec += msec;
+        }
+        printf("Join %s: connected in %lu ms\n", join_state==JOIN_FAST ? "fast" : "scan", msec);
+        if (join_lost)
+        {
+            msec = (usec() - join_down_usec) / 1000;
+            join_stats.reconnects++;
+            join_stats.reconnect_msec += msec;
+            join_stats.reconnect_max = MAX(join_stats.reconnect_max, msec);
+            printf("Link restored after %lu ms\n", msec);
+            join_lost = false;
+        }
+        join_stats.links++;
+        join_stats.link_secs = 0;
+        join_backoff = 0;
+        join_stats_print();
+        join_state = JOIN_UP;
+        get_conn_info(fd);
+    }
+    else if (gop==GOP_STATE_CHANGE && !up)
+    {
+        if (usec() - join_abort_usec < JOIN_ABORT_MSEC*1000)
+            return;
+        if (join_state == JOIN_FAST)
+        {
+            printf("Join fast: failed after %lu ms\n", msec);
+            join_attempt(fd, false);
+        }
+        else if (join_state == JOIN_SCAN)
+        {
+            printf("Join scan: failed after %lu ms\n", msec);
+            log_printf("Join %s failed", join_ssid);
+            join_stats.fails++;
+            join_wait();
+        }
+        else if (join_state == JOIN_UP)
+        {
+            n = sock_link_down(fd);
+            printf("Link down after %lu sec, %d server sockets to restore\n",
+                   join_stats.link_secs, n);
+            join_lost = true;
+            join_down_usec = usec();
+            join_wait();
+        }
+    }
+    else if (gop == GOP_CONN_INFO)
+    {
+        if (verbose)
+            printf("AP %02X:%02X:%02X:%02X:%02X:%02X ch %u RSSI %d\n", cp->bssid[0], cp->bssid[1],
+                   cp->bssid[2], cp->bssid[3], cp->bssid[4], cp->bssid[5], cp->chan, cp->rssi);
+        if (cp->chan>=1 && cp->chan<=14)
+        {
+            memset(&join_cache, 0, sizeof(join_cache));
+            strncpy(join_cache.ssid, join_ssid, sizeof(join_cache.ssid)-1);
+            join_cache.chan = cp->chan;
+            memcpy(join_cache.bssid, cp->bssid, sizeof(join_cache.bssid));
+            join_save = true;
+        }
+    }
+}
+
+// Check for join timeout, or time to retry, and count link uptime;
+// save AP details from the last join (call regularly from main loop)
+void join_poll(int fd)
+{
+    uint32_t msec = (usec() - join_usec) / 1000;
+
+    // Not done in join_event, as a flash write holds up the WiFi events
+    if (join_save)
+    {
+        join_save = false;
+        join_cached = kv_set(JOIN_KV_KEY, &join_cache, sizeof(join_cache)) && kv_flush();
+    }
+    if (join_state==JOIN_FAST && msec>JOIN_FAST_MSEC)
+    {
+        printf("Join fast: timeout\n");
+        join_abort(fd);
+        join_attempt(fd, false);
+    }
+    else if (join_state==JOIN_SCAN && msec>JOIN_SCAN_MSEC)
+    {
+        printf("Join scan: timeout\n");
+        log_printf("Join %s timeout", join_ssid);
+        join_abort(fd);
+        join_stats.fails++;
+        join_wait();
+    }
+    else if (join_state==JOIN_DOWN && msec>join_retry_msec)
+        join_attempt(fd, join_cached);
+    if (!join_ticks)
+        ustimeout(&join_ticks, 0);
+    if (ustimeout(&join_ticks, 1000000) && join_state==JOIN_UP)
+    {
+        join_stats.up_secs++;
+        join_stats.link_secs++;
+    }
+}
+
+// Display join & link statistics
+void join_stats_print(void)
+{
+    JOIN_STATS *js = &join_stats;
+
+    printf("Join fast %lu/%lu ok, avg %lu ms; scan %lu/%lu ok, avg %lu ms; fails %lu\n",
+           js->fast_ok, js->fast, js->fast_ok ? js->fast_msec/js->fast_ok : 0,
+           js->scan_ok, js->scans, js->scan_ok ? js->scan_msec/js->scan_ok : 0, js->fails);
+    printf("Link up %lu times, uptime %lu sec (current %lu); reconnects %lu, avg %lu max %lu ms\n",
+           js->links, js->up_secs, join_state==JOIN_UP ? js->link_secs : 0, js->reconnects,
+           js->reconnects ? js->reconnect_msec/js->reconnects : 0, js->reconnect_max);
+}
+
+// EOF
@@ -0,0 +1,56 @@
+#ifndef __WINC_JOIN_H__
+#define __WINC_JOIN_H__
+
+// ATWINC1500/1510 WiFi network join for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define JOIN_FAST_MSEC  4000        // Time allowed for targeted join
+#define JOIN_SCAN_MSEC  20000       // Time allowed for join with full scan
+#define JOIN_RETRY_MSEC 2000        // Initial delay before retrying join
+#define JOIN_BACKOFF_MAX_MSEC 60000 // Max delay, doubling after each failure
+#define JOIN_ABORT_MSEC 500         // Ignore disconnection this long after abort
+#define JOIN_KV_KEY     "join"      // Key-value store entry for AP details
+
+#define JOIN_IDLE       0
+#define JOIN_FAST       1           // Targeted join in progress
+#define JOIN_SCAN       2           // Join with full scan in progress
+#define JOIN_UP         3
+#define JOIN_DOWN       4           // Waiting to retry
+
+// Details of last AP joined, kept in key-value store
+typedef struct {
+    char ssid[33];
+    uint8_t chan, bssid[6];
+} JOIN_CACHE;
+
+// Join & link statistics; times in msec, uptimes in seconds
+typedef struct {
+    uint32_t fast, fast_ok, scans, scan_ok, fails;
+    uint32_t fast_msec, scan_msec, last_msec;
+    uint32_t links, up_secs, link_secs;
+    uint32_t reconnects, reconnect_msec, reconnect_max;
+} JOIN_STATS;
+
+extern JOIN_STATS join_stats;
+extern int join_state;
+
+bool join_start(int fd, char *ssid, char *pass);
+void join_event(int fd, uint16_t gop, RESP_MSG *rmp);
+void join_poll(int fd);
+void join_stats_print(void);
+
+#endif
+// EOF
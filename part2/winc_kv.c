@@ -0,0 +1,486 @@
+// Key-value store in ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The store is a log of records in a ring of sectors at the top of flash.
+// A record is never rewritten; a new value is appended, and the RAM index
+// is updated to point to it. Appends are collected in RAM, and written a
+// page at a time, or after an idle time, or when kv_flush is called.
+//
+// When the ring is full, the live records in the oldest sector are copied
+// to the head, and the oldest sector is erased. At boot, the sectors are
+// replayed in sequence order to rebuild the index; a record with a bad
+// check value (e.g. partly written at power-down) ends the replay of its
+// sector. Since the store is only a few sectors, the rebuild time is small
+// and bounded, whatever the history of updates. It is measured & reported,
+// with a warning if over KV_BOOT_WARN_MSEC; the replay is never cut short.
+//
+// On a 4 Mbit part, the top of flash is used by the WINC firmware, so the
+// store is only used if the flash has an application area (FLASH_USER_MIN).
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_flash.h"
+#include "winc_ota.h"
+#include "winc_kv.h"
+
+#define KV_TOMB         1           // Index address of deleted entry
+#define KV_NO_ADDR      0xffffffff
+#define KV_PEND_MAX     (FLASH_PAGE_SZ * 2)
+#define KV_SECT_DATA    (FLASH_SECTOR_SZ - sizeof(KV_SECT_HDR))
+#define KV_LIVE_MAX     ((KV_SECTORS - 2) * KV_SECT_DATA)
+#define KV_REC_MAX      ((sizeof(KV_REC_HDR) + KV_KEY_MAX + KV_VALUE_MAX + 3) & ~3)
+
+KV_STATS kv_stats;
+KV_INDEX kv_index[KV_INDEX_SIZE];
+uint8_t kv_sbuff[FLASH_SECTOR_SZ], kv_pend[KV_PEND_MAX];
+uint8_t kv_rec[KV_REC_MAX], kv_cmp[sizeof(KV_REC_HDR) + KV_KEY_MAX];
+uint32_t kv_base, kv_seq, kv_wr, kv_flushed, kv_pend_time, kv_sbuff_addr=KV_NO_ADDR;
+int kv_fd=-1, kv_head, kv_tail, kv_nused;
+bool kv_compacting;
+extern int verbose;
+
+static bool kv_new_sector(void);
+
+// Return address of sector in store
+static uint32_t sect_addr(int n)
+{
+    return(kv_base + n*FLASH_SECTOR_SZ);
+}
+
+// Return FNV-1a hash of key
+static uint32_t kv_hash(char *key, int klen)
+{
+    uint32_t h = 2166136261;
+
+    while (klen-- > 0)
+        h = (h ^ (uint8_t)*key++) * 16777619;
+    return(h);
+}
+
+// Return length of record in flash, including padding
+static int rec_len(KV_REC_HDR *hp)
+{
+    int vlen = hp->vlen==KV_VLEN_DEL ? 0 : hp->vlen;
+
+    return((sizeof(KV_REC_HDR) + hp->klen + vlen + 3) & ~3);
+}
+
+// Return check value of record
+static uint16_t rec_check(uint8_t *rec)
+{
+    KV_REC_HDR *hp = (KV_REC_HDR *)rec;
+    int dlen = hp->klen + (hp->vlen==KV_VLEN_DEL ? 0 : hp->vlen);
+    uint32_t crc = crc32(0, rec, 2);
+
+    return(crc32(crc, &rec[sizeof(KV_REC_HDR)], dlen) & 0xffff);
+}
+
+// Return length of record if valid, 0 if not
+static int rec_valid(uint8_t *rec, int maxlen)
+{
+    KV_REC_HDR *hp = (KV_REC_HDR *)rec;
+    int len;
+
+    if (maxlen < (int)sizeof(KV_REC_HDR) || hp->klen==0 || hp->klen>KV_KEY_MAX ||
+        (hp->vlen>KV_VALUE_MAX && hp->vlen!=KV_VLEN_DEL))
+        return(0);
+    len = rec_len(hp);
+    return(len<=maxlen && hp->check==rec_check(rec) ? len : 0);
+}
+
+// Read record data from flash, sector buffer, or pending buffer
+static bool rec_read(uint32_t addr, int len, uint8_t *buff)
+{
+    int n;
+
+    if (kv_sbuff_addr!=KV_NO_ADDR && addr>=kv_sbuff_addr &&
+        addr+len <= kv_sbuff_addr+FLASH_SECTOR_SZ)
+    {
+        memcpy(buff, &kv_sbuff[addr - kv_sbuff_addr], len);
+        return(true);
+    }
+    // Pending data may be in the middle of the ring, so check both ends
+    if (addr>=kv_flushed && addr<kv_wr)
+        n = 0;
+    else if (addr<kv_flushed && addr+len>kv_flushed)
+        n = kv_flushed - addr;
+    else
+        n = len;
+    if (n>0 && spi_flash_read(kv_fd, buff, addr, n) != M2M_SUCCESS)
+        return(false);
+    if (len > n)
+        memcpy(&buff[n], &kv_pend[addr + n - kv_flushed], len - n);
+    return(true);
+}
+
+// Return index slot for key, -1 if not found
+static int kv_find(char *key, int klen, uint32_t hash)
+{
+    int i, n=hash & (KV_INDEX_SIZE-1);
+    KV_INDEX *ip;
+
+    for (i=0; i<KV_INDEX_SIZE; i++, n=(n+1) & (KV_INDEX_SIZE-1))
+    {
+        ip = &kv_index[n];
+        if (ip->addr == 0)
+            break;
+        if (ip->addr!=KV_TOMB && ip->hash==(uint16_t)(hash >> 16) &&
+            rec_read(ip->addr, sizeof(KV_REC_HDR)+klen, kv_cmp) &&
+            kv_cmp[0]==klen && !memcmp(&kv_cmp[sizeof(KV_REC_HDR)], key, klen))
+            return(n);
+    }
+    return(-1);
+}
+
+// Point index entry at new record, adding an entry if slot is -1
+static bool index_put(int slot, uint32_t hash, uint32_t addr, int len)
+{
+    int i, n=hash & (KV_INDEX_SIZE-1);
+
+    for (i=0; slot<0 && i<KV_INDEX_SIZE; i++, n=(n+1) & (KV_INDEX_SIZE-1))
+    {
+        if (kv_index[n].addr==0 || kv_index[n].addr==KV_TOMB)
+        {
+            slot = n;
+            kv_index[n].len = 0;
+            kv_stats.keys++;
+        }
+    }
+    if (slot < 0)
+        return(false);
+    kv_stats.live_bytes += len - kv_index[slot].len;
+    kv_index[slot].hash = (uint16_t)(hash >> 16);
+    kv_index[slot].len = len;
+    kv_index[slot].addr = addr;
+    return(true);
+}
+
+// Remove index entry
+static void index_del(int slot)
+{
+    kv_stats.live_bytes -= kv_index[slot].len;
+    kv_stats.keys--;
+    kv_index[slot].addr = KV_TOMB;
+    kv_index[slot].len = 0;
+}
+
+// Write pending records to flash; if not all, only up to a page boundary
+static bool kv_write_pend(bool all)
+{
+    uint32_t end = all ? kv_wr : kv_wr & ~(FLASH_PAGE_SZ-1);
+    int n = (int)(end - kv_flushed);
+    bool ok;
+
+    if (n <= 0)
+        return(true);
+    ok = spi_flash_write(kv_fd, kv_pend, kv_flushed, n) == M2M_SUCCESS;
+    memmove(kv_pend, &kv_pend[n], kv_wr - end);
+    kv_flushed = end;
+    kv_stats.flushes++;
+    return(ok);
+}
+
+// Append record to log, return its address (0 if error)
+static uint32_t kv_append(uint8_t *rec, int len)
+{
+    uint32_t addr;
+    int tries=0;
+
+    while (kv_wr + len > sect_addr(kv_head) + FLASH_SECTOR_SZ)
+    {
+        if (kv_compacting || tries++ >= KV_SECTORS || !kv_new_sector())
+            return(0);
+    }
+    addr = kv_wr;
+    memcpy(&kv_pend[kv_wr - kv_flushed], rec, len);
+    kv_wr += len;
+    kv_pend_time = usec();
+    if (kv_wr - kv_flushed >= FLASH_PAGE_SZ && !kv_write_pend(false))
+        return(0);
+    return(addr);
+}
+
+// Copy live records from oldest sector to head, then erase oldest
+static bool kv_compact(void)
+{
+    uint32_t addr=sect_addr(kv_tail), newaddr;
+    int len, slot, oset=sizeof(KV_SECT_HDR);
+    KV_REC_HDR *hp;
+    char *key;
+    bool ok;
+
+    if (!kv_write_pend(true) ||
+        spi_flash_read(kv_fd, kv_sbuff, addr, FLASH_SECTOR_SZ) != M2M_SUCCESS)
+        return(false);
+    kv_sbuff_addr = addr;
+    kv_compacting = true;
+    while ((len = rec_valid(&kv_sbuff[oset], FLASH_SECTOR_SZ-oset)) > 0)
+    {
+        hp = (KV_REC_HDR *)&kv_sbuff[oset];
+        key = (char *)&kv_sbuff[oset + sizeof(KV_REC_HDR)];
+        if (hp->vlen != KV_VLEN_DEL &&
+            (slot = kv_find(key, hp->klen, kv_hash(key, hp->klen))) >= 0 &&
+            kv_index[slot].addr == addr+oset)
+        {
+            if ((newaddr = kv_append(&kv_sbuff[oset], len)) == 0)
+                break;
+            kv_index[slot].addr = newaddr;
+            kv_stats.moved++;
+        }
+        oset += len;
+    }
+    kv_compacting = false;
+    kv_sbuff_addr = KV_NO_ADDR;
+    ok = len==0 && kv_write_pend(true) &&
+         spi_flash_erase(kv_fd, addr, FLASH_SECTOR_SZ) == M2M_SUCCESS;
+    if (ok)
+    {
+        kv_tail = (kv_tail + 1) % KV_SECTORS;
+        kv_nused--;
+        kv_stats.compactions++;
+    }
+    return(ok);
+}
+
+// Start a new head sector, compacting the oldest if none are free
+static bool kv_new_sector(void)
+{
+    KV_SECT_HDR hdr = {KV_MAGIC, kv_seq+1};
+    int next = (kv_head + 1) % KV_SECTORS;
+
+    if (!kv_write_pend(true) ||
+        spi_flash_write(kv_fd, (uint8_t *)&hdr, sect_addr(next), sizeof(hdr)) != M2M_SUCCESS)
+        return(false);
+    kv_head = next;
+    kv_seq++;
+    kv_nused++;
+    kv_wr = kv_flushed = sect_addr(next) + sizeof(hdr);
+    return(kv_nused < KV_SECTORS || kv_compact());
+}
+
+// Replay the records in a sector, return offset of end of data
+static int kv_replay(int n)
+{
+    uint32_t addr=sect_addr(n);
+    int len, slot, oset=sizeof(KV_SECT_HDR), end=FLASH_SECTOR_SZ;
+    KV_REC_HDR *hp;
+    uint32_t hash;
+    char *key;
+
+    if (spi_flash_read(kv_fd, kv_sbuff, addr, FLASH_SECTOR_SZ) != M2M_SUCCESS)
+        return(end);
+    kv_sbuff_addr = addr;
+    while ((len = rec_valid(&kv_sbuff[oset], FLASH_SECTOR_SZ-oset)) > 0)
+    {
+        hp = (KV_REC_HDR *)&kv_sbuff[oset];
+        key = (char *)&kv_sbuff[oset + sizeof(KV_REC_HDR)];
+        hash = kv_hash(key, hp->klen);
+        slot = kv_find(key, hp->klen, hash);
+        if (hp->vlen == KV_VLEN_DEL)
+        {
+            if (slot >= 0)
+                index_del(slot);
+        }
+        else
+            index_put(slot, hash, addr+oset, len);
+        oset += len;
+    }
+    kv_sbuff_addr = KV_NO_ADDR;
+    while (end>oset && kv_sbuff[end-1]==0xff)
+        end--;
+    if (end > oset && verbose)
+        printf("KV sector %u: %u bytes unreadable at %u\n", n, end-oset, oset);
+    return((end + 3) & ~3);
+}
+
+// Mount key-value store at top of flash, formatting it if necessary
+bool kv_init(int fd)
+{
+    KV_SECT_HDR hdrs[KV_SECTORS];
+    uint32_t t=usec();
+    int i, n, head=-1, oset=FLASH_SECTOR_SZ;
+    bool ok=true;
+
+    kv_fd = -1;
+    if ((kv_base = spi_flash_get_size(fd) * 1024 * 1024 / 8) < FLASH_USER_MIN)
+    {
+        printf("KV: no application area in %lu KB flash\n", kv_base / 1024);
+        return(false);
+    }
+    kv_fd = fd;
+    kv_base -= KV_SIZE;
+    kv_wr = kv_flushed = 0;
+    memset(kv_index, 0, sizeof(kv_index));
+    memset(&kv_stats, 0, sizeof(kv_stats));
+    for (i=0; i<KV_SECTORS; i++)
+    {
+        ok = ok && spi_flash_read(fd, (uint8_t *)&hdrs[i], sect_addr(i), sizeof(KV_SECT_HDR)) == M2M_SUCCESS;
+        if (ok && hdrs[i].magic==KV_MAGIC && hdrs[i].seq!=KV_NO_ADDR &&
+            (head<0 || hdrs[i].seq>hdrs[head].seq))
+            head = i;
+    }
+    if (!ok)
+    {
+        kv_fd = -1;
+        return(false);
+    }
+    kv_head = head;
+    kv_tail = head<0 ? 0 : head;
+    kv_nused = 0;
+    if (head >= 0)
+    {
+        // Find oldest sector in unbroken sequence before head
+        kv_seq = hdrs[head].seq;
+        kv_nused = 1;
+        for (n=1; n<KV_SECTORS; n++)
+        {
+            i = (head + KV_SECTORS - n) % KV_SECTORS;
+            if (hdrs[i].magic!=KV_MAGIC || hdrs[i].seq!=kv_seq-n)
+                break;
+            kv_tail = i;
+            kv_nused++;
+        }
+        for (n=0; n<kv_nused; n++)
+            oset = kv_replay((kv_tail + n) % KV_SECTORS);
+        kv_wr = kv_flushed = sect_addr(head) + oset;
+    }
+    // Erase any sectors not in use
+    for (n=kv_nused; ok && n<KV_SECTORS; n++)
+    {
+        i = (kv_tail + n) % KV_SECTORS;
+        ok = spi_flash_read(fd, kv_sbuff, sect_addr(i), FLASH_SECTOR_SZ) == M2M_SUCCESS;
+        for (oset=0; ok && oset<FLASH_SECTOR_SZ && kv_sbuff[oset]==0xff; oset++) ;
+        if (ok && oset < FLASH_SECTOR_SZ)
+            ok = spi_flash_erase(fd, sect_addr(i), FLASH_SECTOR_SZ) == M2M_SUCCESS;
+    }
+    if (ok && head < 0)
+    {
+        printf("KV format %u sectors\n", KV_SECTORS);
+        kv_head = KV_SECTORS - 1;
+        kv_tail = 0;
+        kv_seq = 0;
+        ok = kv_new_sector();
+    }
+    // Power lost during compaction: finish it
+    else if (ok && kv_nused >= KV_SECTORS)
+        ok = kv_compact();
+    kv_stats.boot_usec = usec() - t;
+    printf("KV %s seq %lu, %lu keys, %lu bytes, %u sectors, %lu usec\n", ok ? "mounted" : "failed",
+           kv_seq, kv_stats.keys, kv_stats.live_bytes, kv_nused, kv_stats.boot_usec);
+    if (kv_stats.boot_usec > KV_BOOT_WARN_MSEC*1000)
+        printf("KV boot time exceeds %u msec\n", KV_BOOT_WARN_MSEC);
+    if (!ok)
+        kv_fd = -1;
+    return(ok);
+}
+
+// Get value for key, return its length, or -1 if not found
+int kv_get(char *key, void *val, int maxlen)
+{
+    int klen=strlen(key), slot, vlen;
+
+    if (kv_fd<0 || klen<1 || klen>KV_KEY_MAX ||
+        (slot = kv_find(key, klen, kv_hash(key, klen))) < 0 ||
+        !rec_read(kv_index[slot].addr, kv_index[slot].len, kv_rec))
+        return(-1);
+    vlen = ((KV_REC_HDR *)kv_rec)->vlen;
+    memcpy(val, &kv_rec[sizeof(KV_REC_HDR) + klen], MIN(vlen, maxlen));
+    return(vlen);
+}
+
+// Set value for key; nothing is written if the value is unchanged
+bool kv_set(char *key, void *val, int len)
+{
+    int klen=strlen(key), slot, reclen, oldlen=0;
+    uint32_t hash=kv_hash(key, klen), addr;
+    KV_REC_HDR *hp = (KV_REC_HDR *)kv_rec;
+
+    if (kv_fd<0 || klen<1 || klen>KV_KEY_MAX || len<0 || len>KV_VALUE_MAX)
+        return(false);
+    if ((slot = kv_find(key, klen, hash)) >= 0)
+    {
+        oldlen = kv_index[slot].len;
+        if (rec_read(kv_index[slot].addr, oldlen, kv_rec) && hp->vlen==len &&
+            !memcmp(&kv_rec[sizeof(KV_REC_HDR) + klen], val, len))
+        {
+            kv_stats.unchanged++;
+            return(true);
+        }
+    }
+    hp->klen = klen;
+    hp->vlen = len;
+    memcpy(&kv_rec[sizeof(KV_REC_HDR)], key, klen);
+    memcpy(&kv_rec[sizeof(KV_REC_HDR) + klen], val, len);
+    reclen = rec_len(hp);
+    memset(&kv_rec[sizeof(KV_REC_HDR) + klen + len], 0, reclen - (sizeof(KV_REC_HDR) + klen + len));
+    hp->check = rec_check(kv_rec);
+    if ((slot<0 && kv_stats.keys>=KV_MAX_KEYS) ||
+        kv_stats.live_bytes - oldlen + reclen > KV_LIVE_MAX ||
+        (addr = kv_append(kv_rec, reclen)) == 0)
+        return(false);
+    // Compaction may have moved the old record, but not its index slot
+    kv_stats.sets++;
+    return(index_put(slot, hash, addr, reclen));
+}
+
+// Delete key, return false if not found
+bool kv_delete(char *key)
+{
+    int klen=strlen(key), slot;
+    KV_REC_HDR *hp = (KV_REC_HDR *)kv_rec;
+
+    if (kv_fd<0 || klen<1 || klen>KV_KEY_MAX ||
+        (slot = kv_find(key, klen, kv_hash(key, klen))) < 0)
+        return(false);
+    hp->klen = klen;
+    hp->vlen = KV_VLEN_DEL;
+    memcpy(&kv_rec[sizeof(KV_REC_HDR)], key, klen);
+    memset(&kv_rec[sizeof(KV_REC_HDR) + klen], 0, rec_len(hp) - (sizeof(KV_REC_HDR) + klen));
+    hp->check = rec_check(kv_rec);
+    if (kv_append(kv_rec, rec_len(hp)) == 0)
+        return(false);
+    index_del(slot);
+    kv_stats.deletes++;
+    return(true);
+}
+
+// Write all pending records to flash
+bool kv_flush(void)
+{
+    return(kv_fd<0 || kv_write_pend(true));
+}
+
+// Write pending records to flash after an idle time
+void kv_task(void)
+{
+    if (kv_fd>=0 && kv_wr>kv_flushed && usec()-kv_pend_time > KV_FLUSH_MSEC*1000)
+        kv_write_pend(true);
+}
+
+// Display key-value store statistics
+void kv_stats_print(void)
+{
+    printf("KV keys %lu, live %lu bytes, sets %lu unchanged %lu deletes %lu, "
+           "flushes %lu, compactions %lu moved %lu, boot %lu usec\n",
+           kv_stats.keys, kv_stats.live_bytes, kv_stats.sets, kv_stats.unchanged,
+           kv_stats.deletes, kv_stats.flushes, kv_stats.compactions, kv_stats.moved,
+           kv_stats.boot_usec);
+}
+
+// EOF
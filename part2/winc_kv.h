@@ -0,0 +1,66 @@
+#ifndef __WINC_KV_H__
+#define __WINC_KV_H__
+
+// Key-value store in ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define KV_SECTORS      4           // Flash sectors at top of flash for store
+#define KV_SIZE         (KV_SECTORS * FLASH_SECTOR_SZ)
+#define KV_MAGIC        0x3153564b  // "KVS1"
+#define KV_KEY_MAX      32          // Max key length
+#define KV_VALUE_MAX    200         // Max value length
+#define KV_INDEX_SIZE   64          // RAM index entries (power of 2)
+#define KV_MAX_KEYS     (KV_INDEX_SIZE * 3 / 4)
+#define KV_FLUSH_MSEC   1000        // Idle time before writing pending records
+#define KV_BOOT_WARN_MSEC 50        // Warn if index rebuild at boot takes longer
+#define KV_VLEN_DEL     0xfe        // Value length of a deletion record
+
+// Sector header
+typedef struct {
+    uint32_t magic, seq;
+} KV_SECT_HDR;
+
+// Record header, followed by key & value, padded to 4 bytes.
+// A key length of 0xff marks the end of the records in a sector
+typedef struct {
+    uint8_t klen, vlen;
+    uint16_t check;
+} KV_REC_HDR;
+
+// RAM index entry: key hash, record length & flash address
+typedef struct {
+    uint16_t hash, len;
+    uint32_t addr;
+} KV_INDEX;
+
+// Key-value store statistics
+typedef struct {
+    uint32_t keys, live_bytes, sets, deletes, unchanged;
+    uint32_t flushes, compactions, moved, boot_usec;
+} KV_STATS;
+
+extern KV_STATS kv_stats;
+
+bool kv_init(int fd);
+int kv_get(char *key, void *val, int maxlen);
+bool kv_set(char *key, void *val, int len);
+bool kv_delete(char *key);
+bool kv_flush(void);
+void kv_task(void);
+void kv_stats_print(void);
+
+#endif
+// EOF
@@ -0,0 +1,229 @@
+// Event log in ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Events are collected in a page buffer, which is written to flash when
+// its oldest unwritten event reaches LOG_FLUSH_MSEC; the new records are
+// programmed into the erased tail of the page, so a page can be written
+// several times before it is full. The length & check value in the page
+// header are left erased (0xffff) until the page is complete; a reader
+// then takes records up to the first erased record header. The log area
+// is a ring of pages, each with an increasing sequence number; the sector
+// ahead of the newest page is erased as the log wraps. At boot, the first
+// page of each sector is checked to find the newest sector, then its
+// pages are checked to find the newest page; logging resumes on the page
+// after it. Like the key-value store, the log is only used on parts with
+// an application area above the WINC firmware.
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_flash.h"
+#include "winc_ota.h"
+#include "winc_kv.h"
+#include "winc_log.h"
+
+#define PAGES_PER_SECT  (FLASH_SECTOR_SZ / FLASH_PAGE_SZ)
+#define LOG_NO_SEQ      0xffffffff
+
+LOG_STATS log_stats;
+uint8_t log_page[FLASH_PAGE_SZ];
+uint32_t log_base, log_seq, log_msec, log_last_usec, log_pend_time;
+int log_fd=-1, log_npage, log_oset, log_written;
+
+// Return address of page in log area
+static uint32_t page_addr(int n)
+{
+    return(log_base + n*FLASH_PAGE_SZ);
+}
+
+// Return sequence number in page header
+static uint32_t page_seq(int n)
+{
+    LOG_PAGE_HDR hdr;
+
+    if (spi_flash_read(log_fd, (uint8_t *)&hdr, page_addr(n), sizeof(hdr)) != M2M_SUCCESS)
+        return(LOG_NO_SEQ);
+    return(hdr.seq);
+}
+
+// Return msec time since boot, extended beyond the usec timer wrap
+static uint32_t log_time(void)
+{
+    uint32_t t=usec(), dt=t-log_last_usec;
+
+    log_msec += dt / 1000;
+    log_last_usec = t - dt%1000;
+    return(log_msec);
+}
+
+// Return true if page buffer has events not yet written to flash
+static bool log_pending(void)
+{
+    return(log_oset > MAX(log_written, (int)sizeof(LOG_PAGE_HDR)));
+}
+
+// Write new events in page buffer to flash, erasing the sector first
+// if starting one. If page is complete, add length & check value to
+// its header, and move on to the next page
+static bool log_write_page(bool full)
+{
+    LOG_PAGE_HDR *hp = (LOG_PAGE_HDR *)log_page;
+    bool ok=true;
+
+    if (log_oset <= sizeof(LOG_PAGE_HDR))
+        return(true);
+    if (log_written == 0)
+    {
+        if (log_npage % PAGES_PER_SECT == 0)
+        {
+            ok = spi_flash_erase(log_fd, page_addr(log_npage), FLASH_SECTOR_SZ) == M2M_SUCCESS;
+            log_stats.erases++;
+        }
+        hp->seq = log_seq++;
+        hp->len = hp->check = 0xffff;
+    }
+    if (full)
+    {
+        hp->len = log_oset - sizeof(LOG_PAGE_HDR);
+        hp->check = crc32(0, &log_page[sizeof(LOG_PAGE_HDR)], hp->len) & 0xffff;
+    }
+    if (log_written == 0)
+        ok = ok && spi_flash_write(log_fd, log_page, page_addr(log_npage), log_oset) == M2M_SUCCESS;
+    else
+    {
+        if (log_oset > log_written)
+            ok = ok && spi_flash_write(log_fd, &log_page[log_written], page_addr(log_npage) + log_written,
+                                       log_oset - log_written) == M2M_SUCCESS;
+        if (full)
+            ok = ok && spi_flash_write(log_fd, (uint8_t *)&hp->len, page_addr(log_npage) + offsetof(LOG_PAGE_HDR, len), 4) == M2M_SUCCESS;
+    }
+    log_written = log_oset;
+    if (full)
+    {
+        log_stats.pages++;
+        log_npage = (log_npage + 1) % LOG_PAGES;
+        log_oset = sizeof(LOG_PAGE_HDR);
+        log_written = 0;
+    }
+    return(ok);
+}
+
+// Find newest page in log area, and prepare to write the next
+bool log_init(int fd)
+{
+    uint32_t size=spi_flash_get_size(fd) * 1024 * 1024 / 8, seq, newest=0;
+    int n, sect=-1, page=-1;
+
+    log_fd = -1;
+    if (size < FLASH_USER_MIN)
+    {
+        printf("Log: no application area in %lu KB flash\n", size / 1024);
+        return(false);
+    }
+    log_fd = fd;
+    log_base = size - KV_SIZE - LOG_SIZE;
+    for (n=0; n<LOG_SECTORS; n++)
+    {
+        if ((seq = page_seq(n * PAGES_PER_SECT)) != LOG_NO_SEQ && (sect<0 || seq>newest))
+        {
+            sect = n;
+            newest = seq;
+        }
+    }
+    for (n=0; sect>=0 && n<PAGES_PER_SECT; n++)
+    {
+        seq = page_seq(sect*PAGES_PER_SECT + n);
+        if (seq==LOG_NO_SEQ || seq<newest)
+            break;
+        page = sect*PAGES_PER_SECT + n;
+        newest = seq;
+    }
+    log_seq = page<0 ? 1 : newest + 1;
+    log_npage = page<0 ? 0 : (page + 1) % LOG_PAGES;
+    log_oset = sizeof(LOG_PAGE_HDR);
+    log_written = 0;
+    log_last_usec = usec();
+    log_msec = 0;
+    printf("Log seq %lu, page %u\n", log_seq, log_npage);
+    return(true);
+}
+
+// Add event to log
+bool log_event(int id, void *data, int len)
+{
+    LOG_REC_HDR rh = {log_time(), id, len};
+
+    if (log_fd<0 || len<0 || len>LOG_DATA_MAX ||
+        (log_oset + sizeof(rh) + len > FLASH_PAGE_SZ && !log_write_page(true)))
+    {
+        log_stats.dropped++;
+        return(false);
+    }
+    if (!log_pending())
+        log_pend_time = usec();
+    memcpy(&log_page[log_oset], &rh, sizeof(rh));
+    memcpy(&log_page[log_oset + sizeof(rh)], data, len);
+    log_oset += sizeof(rh) + len;
+    log_stats.events++;
+    return(true);
+}
+
+// Add text event to log, truncated if too long
+bool log_printf(const char *fmt, ...)
+{
+    char s[LOG_DATA_MAX+1];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(s, sizeof(s), fmt, args);
+    va_end(args);
+    return(n>=0 && log_event(LOG_TEXT, s, MIN(n, LOG_DATA_MAX)));
+}
+
+// Write new events in part-filled page to flash
+bool log_flush(void)
+{
+    if (log_fd<0 || !log_pending())
+        return(true);
+    log_stats.part_pages++;
+    return(log_write_page(false));
+}
+
+// Keep time up to date, and write page when its oldest event is due
+void log_task(void)
+{
+    if (log_fd >= 0)
+    {
+        log_time();
+        if (log_pending() && usec()-log_pend_time > LOG_FLUSH_MSEC*1000)
+            log_flush();
+    }
+}
+
+// Display event log statistics
+void log_stats_print(void)
+{
+    printf("Log events %lu dropped %lu, pages %lu (%lu part-page writes), erases %lu\n",
+           log_stats.events, log_stats.dropped, log_stats.pages,
+           log_stats.part_pages, log_stats.erases);
+}
+
+// EOF
@@ -0,0 +1,62 @@
+#ifndef __WINC_LOG_H__
+#define __WINC_LOG_H__
+
+// Event log in ATWINC1500/1510 flash, for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define LOG_SECTORS     16          // Flash sectors for log, below key-value store
+#define LOG_SIZE        (LOG_SECTORS * FLASH_SECTOR_SZ)
+#define LOG_PAGES       (LOG_SIZE / FLASH_PAGE_SZ)
+#define LOG_DATA_MAX    64          // Max data length of an event
+#define LOG_FLUSH_MSEC  5000        // Max time an event is held in RAM
+
+// Event identifiers
+#define LOG_BOOT        1           // Data: boot count
+#define LOG_TEXT        2           // Data: text string
+#define LOG_WIFI_STATE  3           // Data: connection state byte
+#define LOG_DHCP        4           // Data: IP address
+#define LOG_OTA         5           // Data: status, address, size, CRC
+
+// Page header; the check value covers the record data. Length & check
+// are left erased (0xffff) until the page is complete
+typedef struct {
+    uint32_t seq;
+    uint16_t len, check;
+} LOG_PAGE_HDR;
+
+// Event record header, followed by data; records don't span pages
+typedef struct {
+    uint32_t msec;
+    uint16_t id, len;
+} LOG_REC_HDR;
+
+// Event log statistics
+typedef struct {
+    uint32_t events, dropped, pages, part_pages, erases;
+} LOG_STATS;
+
+extern LOG_STATS log_stats;
+extern uint32_t log_base;
+
+bool log_init(int fd);
+bool log_event(int id, void *data, int len);
+bool log_printf(const char *fmt, ...);
+bool log_flush(void);
+void log_task(void);
+void log_stats_print(void);
+
+#endif
+// EOF
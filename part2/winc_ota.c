@@ -0,0 +1,217 @@
+// ATWINC1500/1510 WiFi module OTA flash update for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The image is received over TCP into a single sector buffer; each
+// complete sector is erased & written to flash before more data is
+// accepted, so RAM use is independent of image size
+//
+// Images can only be written to the OTA region of the application area,
+// so a client can't overwrite the WINC firmware, or the other stored data.
+// The flash is written directly, so the MSC disk cache is discarded
+// before and after the transfer
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "winc_wifi.h"
+#include "winc_sock.h"
+#include "winc_flash.h"
+#include "winc_ota.h"
+#include "winc_log.h"
+#ifdef USE_USB_MSC
+#include "msc_disk.h"
+#endif
+
+OTA_STATE ota;
+OTA_HDR ota_rx_hdr;
+uint8_t ota_buff[FLASH_SECTOR_SZ];
+extern int verbose;
+
+// Update CRC-32 (as used by zlib) with a block of data; start with crc=0
+uint32_t crc32(uint32_t crc, uint8_t *data, int len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+    crc = ~crc;
+    while (len-- > 0)
+    {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return(~crc);
+}
+
+// Handler for streamed flash read, to update CRC
+bool ota_crc_handler(void *ctx, uint32_t addr, uint8_t *data, uint32_t len)
+{
+    uint32_t *crcp = ctx;
+
+    *crcp = crc32(*crcp, data, len);
+    return(true);
+}
+
+// Send 32-bit value to OTA client
+bool ota_reply(int fd, uint8_t sock, uint32_t val)
+{
+    return(put_sock_send(fd, sock, &val, sizeof(val)));
+}
+
+// End the transfer, sending status to client, and forget the image
+void ota_end(int fd, uint8_t sock, uint32_t status)
+{
+    uint32_t event[4] = {status, ota.hdr.addr, ota.hdr.size, ota.hdr.crc};
+
+    ota_reply(fd, sock, status);
+    log_event(LOG_OTA, event, sizeof(event));
+    printf("OTA %s\n", status==OTA_OK ? "complete" : status==OTA_ERR_HDR ?
+           "invalid header" : status==OTA_ERR_FLASH ? "flash error" : "CRC error");
+    if (status == OTA_OK)
+        ota_stats_print();
+    memset(&ota.hdr, 0, sizeof(ota.hdr));
+    ota.active = false;
+#ifdef USE_USB_MSC
+    msc_cache_init(MSC_CACHE_SIZE);
+#endif
+    put_sock_close(fd, sock);
+}
+
+// Check new header; start a new image, or resume the last one
+bool ota_start(int fd, uint8_t sock)
+{
+    OTA_HDR *hp = &ota_rx_hdr;
+    uint32_t flash_bytes = spi_flash_get_size(fd) * 1024 * 1024 / 8;
+
+    if (hp->magic!=OTA_MAGIC || hp->size==0 || hp->addr%FLASH_SECTOR_SZ ||
+        flash_bytes < FLASH_USER_MIN || hp->addr < FLASH_OTA_BASE ||
+        hp->addr >= FLASH_OTA_BASE+FLASH_OTA_SIZE ||
+        hp->size > FLASH_OTA_BASE+FLASH_OTA_SIZE-hp->addr)
+        return(false);
+#ifdef USE_USB_MSC
+    msc_cache_init(MSC_CACHE_SIZE);
+#endif
+    if (memcmp(hp, &ota.hdr, sizeof(OTA_HDR)) || ota.done >= hp->size)
+    {
+        memcpy(&ota.hdr, hp, sizeof(OTA_HDR));
+        ota.done = ota.rx_usec = ota.flash_usec = ota.verify_usec = 0;
+        ota.start = usec();
+        printf("OTA start addr %lx size %lu\n", hp->addr, hp->size);
+    }
+    else
+        printf("OTA resume addr %lx at %lu\n", hp->addr, ota.done);
+    ota.buff_len = 0;
+    return(ota_reply(fd, sock, ota.done));
+}
+
+// Write sector buffer to flash; when image complete, verify it
+bool ota_flush(int fd, uint8_t sock)
+{
+    uint32_t t=usec(), crc=0, addr=ota.hdr.addr+ota.done;
+    bool ok;
+
+    ok = spi_flash_erase(fd, addr, FLASH_SECTOR_SZ) == M2M_SUCCESS &&
+         spi_flash_write(fd, ota_buff, addr, ota.buff_len) == M2M_SUCCESS;
+    ota.flash_usec += usec() - t;
+    if (!ok)
+    {
+        ota_end(fd, sock, OTA_ERR_FLASH);
+        return(false);
+    }
+    ota.done += ota.buff_len;
+    ota.buff_len = 0;
+    if (ota.done == ota.hdr.size)
+    {
+        t = usec();
+        ok = spi_flash_read_stream(fd, ota.hdr.addr, ota.hdr.size, ota_buff,
+                FLASH_SECTOR_SZ, ota_crc_handler, &crc) == M2M_SUCCESS;
+        ota.verify_usec = usec() - t;
+        ota_end(fd, sock, !ok ? OTA_ERR_FLASH : crc!=ota.hdr.crc ? OTA_ERR_CRC : OTA_OK);
+    }
+    return(true);
+}
+
+// Handler for OTA socket: header, then image data
+void ota_handler(int fd, uint8_t sock, int rxlen)
+{
+    uint32_t t=usec();
+    int n, oset=0;
+
+    if (verbose > 1)
+        printf("OTA Rx socket %u len %d %s\n", sock, rxlen,
+               rxlen<=0 ? sock_err_str(rxlen) : "");
+    if (rxlen < 0)
+    {
+        if (ota.active && ota.sock==sock)
+            ota.active = false;
+        put_sock_close(fd, sock);
+        return;
+    }
+    if (ota.active && ota.sock!=sock)
+    {
+        ota_reply(fd, sock, OTA_ERR_HDR);
+        put_sock_close(fd, sock);
+        return;
+    }
+    if (!ota.active)
+    {
+        ota.active = true;
+        ota.sock = sock;
+        ota.hdr_len = 0;
+    }
+    while (ota.active && oset < rxlen)
+    {
+        if (ota.hdr_len < sizeof(OTA_HDR))
+        {
+            n = MIN(rxlen-oset, sizeof(OTA_HDR)-ota.hdr_len);
+            get_sock_data_oset(fd, sock, oset, (uint8_t *)&ota_rx_hdr+ota.hdr_len, n);
+            ota.hdr_len += n;
+            if (ota.hdr_len==sizeof(OTA_HDR) && !ota_start(fd, sock))
+                ota_end(fd, sock, OTA_ERR_HDR);
+        }
+        else
+        {
+            n = MIN(rxlen-oset, FLASH_SECTOR_SZ-ota.buff_len);
+            n = MIN(n, ota.hdr.size-ota.done-ota.buff_len);
+            if (n <= 0)
+                break;
+            get_sock_data_oset(fd, sock, oset, &ota_buff[ota.buff_len], n);
+            ota.buff_len += n;
+            if ((ota.buff_len==FLASH_SECTOR_SZ || ota.done+ota.buff_len==ota.hdr.size) &&
+                !ota_flush(fd, sock))
+                break;
+        }
+        oset += n;
+    }
+    ota.rx_usec += usec() - t;
+}
+
+// Display OTA throughput
+void ota_stats_print(void)
+{
+    uint32_t total = usec() - ota.start, kb = ota.hdr.size / 1024;
+
+    printf("OTA %lu bytes in %lu ms, %lu KB/s, %lu ms/MB\n", ota.hdr.size, total/1000,
+           total ? (uint32_t)(ota.hdr.size * 1000ULL / total) : 0,
+           kb ? (uint32_t)(total / 1000ULL * 1024 / kb) : 0);
+    printf("  Rx handler %lu ms (flash erase/write %lu ms), verify %lu ms\n",
+           ota.rx_usec/1000, ota.flash_usec/1000, ota.verify_usec/1000);
+}
+// EOF
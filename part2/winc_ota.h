@@ -0,0 +1,52 @@
+#ifndef __WINC_OTA_H__
+#define __WINC_OTA_H__
+
+// ATWINC1500/1510 WiFi OTA flash update definitions for the Pi Pico
+//
+// Copyright (c) 2021 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define OTA_PORTNUM     1026        // TCP port for OTA updates
+#define OTA_MAGIC       0x3141544f  // 'OTA1', little-endian
+
+// OTA status values, sent to client after image is complete
+#define OTA_OK          0
+#define OTA_ERR_HDR     1           // Invalid header
+#define OTA_ERR_FLASH   2           // Flash erase or write failed
+#define OTA_ERR_CRC     3           // Verification failed
+
+// Image header, sent by client at start of each connection (little-endian).
+// Server replies with 32-bit offset to resume from, then after the
+// image is complete, with a 32-bit status value
+typedef struct {
+    uint32_t magic, addr, size, crc;
+} OTA_HDR;
+
+// OTA receiver state; kept between connections, so an interrupted
+// transfer of the same image can resume at the last complete sector
+typedef struct {
+    OTA_HDR hdr;
+    bool active;
+    uint8_t sock;
+    int hdr_len;
+    uint32_t done, buff_len;
+    uint32_t start, rx_usec, flash_usec, verify_usec;
+} OTA_STATE;
+
+uint32_t crc32(uint32_t crc, uint8_t *data, int len);
+void ota_handler(int fd, uint8_t sock, int rxlen);
+void ota_stats_print(void);
+
+#endif
+// EOF
@@ -23,16 +23,39 @@
 #include "hardware/spi.h"
 #ifdef USE_USB_MSC
 #include "bsp/board.h"
+#include "msc_disk.h"
+#include "usb_flash.h"
 #endif
 #include "tusb.h"
 #include "winc_wifi.h"
 #include "winc_sock.h"
 #include "winc_flash.h"
+#include "winc_ota.h"
+#include "winc_kv.h"
+#include "winc_log.h"
+#include "winc_join.h"
+#include "winc_ip.h"
+#include "winc_dns.h"
+#ifdef USE_USB_MSC
+#include "winc_fat.h"
+#include "winc_http.h"
+#endif
 #include "credentials.h"
 
 #define VERBOSE     3           // Diagnostic output level (0 to 3)
 #define SPI_SPEED   11000000    // SPI clock (actually 10.42 MHz)
 #define NEW_CHIP   1
+#define UDP_BENCH   0           // UDP server runs send benchmark, not echo
+#define DNS_TEST    0           // Look up DNS_TEST_HOST at each display interval
+#define TCP_IDLE_MSEC   60000   // Close TCP connections idle this long (0 to disable)
+#define TCP_KEEPIDLE    20      // TCP keepalive idle time (500 msec units, 0 to disable)
+#define TCP_KEEPINTVL   4       // TCP keepalive probe interval (500 msec units)
+#define TCP_KEEPCNT     5       // TCP keepalive probes before disconnect
+#define TCP_BACKLOG     4       // TCP listen backlog
+#define TCP_ACCEPTQ     4       // Host-side accept queue (0 to service immediately)
+#define FLASH_IDLE_MSEC 2000    // Flash power-down after this idle time (0 to disable)
+#define LATENCY_MSEC    10000   // Interval for WiFi event latency display
+#define DNS_TEST_HOST   "raspberrypi.com"   // Host for DNS cache test
 
 #if NEW_CHIP
 #define SPI_PORT    spi1        // SPI port number
@@ -60,6 +83,10 @@
 extern int verbose;
 int g_spi_fd;
 
+// WiFi event latency: time from IRQ assertion to servicing
+volatile uint32_t irq_time;
+uint32_t irq_count, irq_lat_total, irq_lat_max;
+
 // Return microsecond time
 uint32_t usec(void)
 {
@@ -105,6 +132,44 @@ int read_irq(void)
     return(gpio_get(IRQ_PIN));
 }
 
+// Record time of IRQ assertion (falling edge)
+void irq_callback(unsigned int gpio, uint32_t events)
+{
+    if (!irq_time)
+        irq_time = time_us_32() | 1;
+}
+
+// Update IRQ latency, just before servicing IRQ
+void irq_latency(void)
+{
+    uint32_t t = irq_time, lat;
+
+    if (t)
+    {
+        lat = usec() - t;
+        irq_time = 0;
+        irq_count++;
+        irq_lat_total += lat;
+        irq_lat_max = MAX(irq_lat_max, lat);
+    }
+}
+
+// Display IRQ latency, and reset the maximum
+void irq_latency_print(void)
+{
+    if (irq_count)
+        printf("WiFi events %lu, latency avg %lu max %lu usec\n",
+               irq_count, irq_lat_total / irq_count, irq_lat_max);
+    irq_count = irq_lat_total = irq_lat_max = 0;
+}
+
+// Handle result of DNS lookup
+void dns_handler(int fd, char *name, uint32_t ip)
+{
+    if (!ip)
+        printf("DNS %s not found\n", name);
+}
+
 // Initialise SPI interface
 void spi_setup(int fd)
 {
@@ -129,6 +194,7 @@ void spi_setup(int fd)
     gpio_init(IRQ_PIN);
     gpio_set_dir(IRQ_PIN, GPIO_IN);
     gpio_pull_up(IRQ_PIN);
+    gpio_set_irq_enabled_with_callback(IRQ_PIN, GPIO_IRQ_EDGE_FALL, true, irq_callback);
     gpio_init(RESET_PIN);
     gpio_set_dir(RESET_PIN, GPIO_OUT);
     gpio_put(RESET_PIN, 0);
@@ -142,9 +208,9 @@ void spi_setup(int fd)
 
 int main(int argc, char *argv[])
 {
-    uint32_t val=0;
+    uint32_t val=0, latency_ticks=0;
     bool ok, irq=1;
-    int sock;
+    int sock, tcp_sock;
 
     verbose = VERBOSE;
 #ifndef USE_USB_MSC
@@ -171,18 +237,43 @@ int main(int argc, char *argv[])
         ok = chip_get_info(g_spi_fd);
         uint32_t flash_size = spi_flash_get_size(g_spi_fd);
         printf("Flash size: %lu Mb\n", flash_size);
+        spi_flash_set_idle(FLASH_IDLE_MSEC);
+        uint32_t boots=0;
+        if (kv_init(g_spi_fd))
+        {
+            kv_get("boots", &boots, sizeof(boots));
+            boots++;
+            kv_set("boots", &boots, sizeof(boots));
+            kv_flush();
+            printf("Boot count %lu\n", boots);
+        }
+        log_init(g_spi_fd);
+        log_event(LOG_BOOT, &boots, sizeof(boots));
+        dns_cache_init(DNS_CACHE_SIZE, DNS_CACHE_TTL);
 #ifdef USE_USB_MSC
+        msc_disk_init();
         tud_init(0);
 #endif
 
         ok = ok && set_gpio_val(g_spi_fd, 0x58070) && set_gpio_dir(g_spi_fd, 0x58070);
 
-        sock = open_sock_server(TCP_PORTNUM, 1, tcp_echo_handler);
+        tcp_sock = sock = open_sock_server(TCP_PORTNUM, 1, tcp_echo_handler);
         printf("Socket %u TCP port %u %s\n", sock, TCP_PORTNUM, sock>=0 ? "ok" : "failed");
-        sock = open_sock_server(UDP_PORTNUM, 0, udp_echo_handler);
+        sock_set_timeouts(sock, 0, TCP_IDLE_MSEC);
+        sock_set_keepalive(sock, TCP_KEEPIDLE, TCP_KEEPINTVL, TCP_KEEPCNT);
+        sock_set_backlog(sock, TCP_BACKLOG, TCP_ACCEPTQ);
+        sock = open_sock_server(OTA_PORTNUM, 1, ota_handler);
+        printf("Socket %u OTA port %u %s\n", sock, OTA_PORTNUM, sock>=0 ? "ok" : "failed");
+#ifdef USE_USB_MSC
+        sock = http_server_init(HTTP_PORTNUM);
+        printf("Socket %u HTTP port %u %s\n", sock, HTTP_PORTNUM, sock>=0 ? "ok" : "failed");
+        sock_set_timeouts(sock, 0, TCP_IDLE_MSEC);
+        sock_set_backlog(sock, TCP_BACKLOG, 0);
+#endif
+        sock = open_sock_server(UDP_PORTNUM, 0, UDP_BENCH ? udp_bench_handler : udp_echo_handler);
         printf("Socket %u UDP port %u %s\n", sock, UDP_PORTNUM, sock>=0 ? "ok" : "failed");
 
-        ok = join_net(g_spi_fd, PSK_SSID, PSK_PASSPHRASE);
+        ok = ip_init(g_spi_fd, PSK_SSID) && join_start(g_spi_fd, PSK_SSID, PSK_PASSPHRASE);
 
         printf("Connecting");
         while (ok && (irq=read_irq()) && msdelay(100))
@@ -191,13 +282,45 @@ int main(int argc, char *argv[])
             fflush(stdout);
         }
         printf("\n");
+        irq_time = 0;
         while (ok)
         {
 #ifdef USE_USB_MSC
             tud_task();
+            msc_task();
+            usb_flash_task();
 #endif
             if (read_irq() == 0)
+            {
+                irq_latency();
                 interrupt_handler();
+            }
+            if (ustimeout(&latency_ticks, LATENCY_MSEC * 1000))
+            {
+                irq_latency_print();
+                if (tcp_sock >= 0)
+                    sock_listen_stats(tcp_sock);
+                if (stale_events)
+                    printf("Stale socket events %lu\n", stale_events);
+                join_stats_print();
+                ip_stats_print();
+                kv_stats_print();
+                if (DNS_TEST && join_state == JOIN_UP)
+                    dns_resolve(g_spi_fd, DNS_TEST_HOST, dns_handler);
+                dns_cache_stats();
+                log_stats_print();
+#ifdef USE_USB_MSC
+                http_stats_print();
+#endif
+            }
+            while (sock_accept(g_spi_fd, tcp_sock) >= 0) ;
+            sock_poll(g_spi_fd);
+            udp_bench_poll(g_spi_fd);
+            join_poll(g_spi_fd);
+            ip_poll(g_spi_fd);
+            kv_task();
+            log_task();
+            spi_flash_idle(g_spi_fd);
         }
     }
 	return(0);
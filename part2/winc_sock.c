@@ -20,10 +20,16 @@
 #include <stdbool.h>
 #include "winc_wifi.h"
 #include "winc_sock.h"
+#include "winc_log.h"
+#include "winc_join.h"
+#include "winc_ip.h"
 
 SOCKET sockets[MAX_SOCKETS];
 RESP_MSG resp_msg;
+uint32_t stale_events;
+uint16_t last_session;
 uint8_t databuff[SPI_BUFFLEN];
+int bench_sock=-1;
 extern int verbose, spi_fd;
 
 // Socket errors, corresponding to negative length values
@@ -43,14 +49,13 @@ char *sock_err_str(int err)
 int open_sock_server(int portnum, bool tcp, SOCK_HANDLER handler)
 {
     int sock, smin=tcp?MIN_TCP_SOCK:MIN_UDP_SOCK, smax=tcp?MAX_TCP_SOCK:MAX_UDP_SOCK;
-    static uint16_t session=1;
 
     for (sock=smin; sock<smax; sock++)
     {
         if (!sockets[sock].state)
         {
             sockets[sock].localport = portnum;
-            sockets[sock].session = session++;
+            sockets[sock].session = new_session();
             sockets[sock].handler = handler;
             sock_state(sock, STATE_BINDING);
             return(sock);
@@ -59,6 +64,44 @@ int open_sock_server(int portnum, bool tcp, SOCK_HANDLER handler)
     return(-1);
 }
 
+// Return a new non-zero session number
+uint16_t new_session(void)
+{
+    if (++last_session == 0)
+        last_session++;
+    return(last_session);
+}
+
+// Return handle for socket, combining socket number and session
+SOCK_HANDLE sock_handle(int sock)
+{
+    return(sock>=0 && sock<MAX_SOCKETS && sockets[sock].state ?
+           SOCK_HANDLE_MAKE(sock, sockets[sock].session) : SOCK_HANDLE_NONE);
+}
+
+// Return socket number for handle, -ve if socket has been closed or reused
+int sock_from_handle(SOCK_HANDLE h)
+{
+    int sock=SOCK_HANDLE_SOCK(h);
+
+    return(sock<MAX_SOCKETS && sockets[sock].state &&
+           sockets[sock].session==SOCK_HANDLE_SESSION(h) ? sock : -1);
+}
+
+// Check session in response matches socket, count stale events
+bool sock_session_ok(uint8_t sock, uint16_t session)
+{
+    if (sock<MAX_SOCKETS && session!=sockets[sock].session)
+    {
+        stale_events++;
+        if (verbose)
+            printf("Sock %u stale session %u (current %u)\n",
+                   sock, session, sockets[sock].session);
+        return(0);
+    }
+    return(1);
+}
+
 // Interrupt handler
 void interrupt_handler(void)
 {
@@ -83,14 +126,22 @@ void interrupt_handler(void)
     gop = GIDOP((uint16_t)hh.gid, hh.op);
     hlen = MIN((hh.len - HIF_HDR_SIZE), sizeof(RESP_MSG));
 
-    // Read response message
+    // Read response message; fields not sent are zero, not left over
     ok = ok && hlen>0 && hif_get(fd, addr+HIF_HDR_SIZE, rmp, hlen);
+    if (ok && hlen < sizeof(RESP_MSG))
+        memset((uint8_t *)rmp + hlen, 0, sizeof(RESP_MSG) - hlen);
 
     // Act on response
     if (gop==GOP_STATE_CHANGE && ok)
+    {
         sprintf(temps, rmp->val==0 ? "disconnected" : rmp->val==1 ? "connected" : "fail");
+        log_event(LOG_WIFI_STATE, &rmp->val, 1);
+    }
     else if (gop==GOP_DHCP_CONF && ok)
+    {
         sprintf(temps, "%u.%u.%u.%u gate %u.%u.%u.%u", IP_BYTES(rmp->dhcp.self), IP_BYTES(rmp->dhcp.gate));
+        log_event(LOG_DHCP, &rmp->dhcp.self, sizeof(rmp->dhcp.self));
+    }
     else if (gop==GOP_BIND && ok)
         sprintf(temps, "0x%X", rmp->val);
     else if (gop==GOP_ACCEPT && ok)
@@ -110,6 +161,8 @@ void interrupt_handler(void)
         if (rmp->recv.sock < MAX_SOCKETS)
             sockets[rmp->recv.sock].hif_data_addr = addr+HIF_HDR_SIZE+rmp->recv.oset;
     }
+    else if (gop==GOP_SEND && ok)
+        sprintf(temps, "sock %d sent %d", rmp->send.sock, rmp->send.sent);
     if (verbose)
     {
         printf("Interrupt gid %s(%u) op %s(%u) len %u %s\n",
@@ -127,8 +180,18 @@ void check_sock(int fd, uint16_t gop, RESP_MSG *rmp)
 {
     SOCKET *sp;
     uint8_t sock, sock2;
-
-    if (gop==GOP_DHCP_CONF)
+    bool ip_known=false;
+
+    if (gop==GOP_STATE_CHANGE || gop==GOP_DHCP_CONF || gop==GOP_IP_CONFLICT)
+        ip_known = ip_event(fd, gop, rmp);
+    if (gop==GOP_STATE_CHANGE || gop==GOP_CONN_INFO)
+        join_event(fd, gop, rmp);
+    if ((gop==GOP_BIND && !sock_session_ok(rmp->bind.sock, rmp->bind.session)) ||
+        ((gop==GOP_RECV || gop==GOP_RECVFROM) &&
+         !sock_session_ok(rmp->recv.sock, rmp->recv.session)) ||
+        (gop==GOP_SEND && !sock_session_ok(rmp->send.sock, rmp->send.session)))
+        return;
+    if (ip_known)
     {
         for (sock=MIN_SOCKET; sock<MAX_SOCKETS; sock++)
         {
@@ -141,6 +204,7 @@ void check_sock(int fd, uint16_t gop, RESP_MSG *rmp)
              sockets[sock].state==STATE_BINDING)
     {
         sock_state(sock, STATE_BOUND);
+        sockets[sock].listen_time = usec();
         if (sock < MIN_UDP_SOCK)
             put_sock_listen(fd, sock);
         else
@@ -150,28 +214,123 @@ void check_sock(int fd, uint16_t gop, RESP_MSG *rmp)
              (sp=&sockets[sock])->state==STATE_BOUND)
     {
         memcpy(&sp->addr, &rmp->recv.addr, sizeof(SOCK_ADDR));
+        if (rmp->recv.dlen > 0)
+            ip_served();
         if (sp->handler)
             sp->handler(fd, sock, rmp->recv.dlen);
         put_sock_recvfrom(fd, sock);
     }
     else if (gop==GOP_ACCEPT &&
              (sock=rmp->accept.listen_sock)<MAX_SOCKETS &&
-             (sock2=rmp->accept.conn_sock)<MAX_SOCKETS &&
-             sockets[sock].state==STATE_BOUND)
+             (sp=&sockets[sock])->state==STATE_BOUND)
     {
-        memcpy(&sockets[sock2].addr, &rmp->recv.addr, sizeof(SOCK_ADDR));
-        sockets[sock2].handler = sockets[sock].handler;
-        sock_state(sock2, STATE_CONNECTED);
-        put_sock_recv(fd, sock2);
+        sock2 = rmp->accept.conn_sock;
+        if (sock2>=MAX_SOCKETS || (sp->aq_size && sp->aq_count>=sp->aq_size))
+        {
+            sp->refusals++;
+            if (sock2 < MAX_SOCKETS)
+                put_sock_close(fd, sock2);
+        }
+        else
+        {
+            sp->accepts++;
+            ip_served();
+            memcpy(&sockets[sock2].addr, &rmp->accept.addr, sizeof(SOCK_ADDR));
+            sockets[sock2].conn_sock = sock;
+            sockets[sock2].session = new_session();
+            if (sp->aq_size)
+            {
+                sock_state(sock2, STATE_ACCEPTED);
+                sp->acceptq[sp->aq_in] = sock2;
+                sp->aq_in = (sp->aq_in + 1) % ACCEPTQ_LEN;
+                sp->aq_count++;
+            }
+            else
+                sock_connected(fd, sock2);
+        }
     }
     else if (gop==GOP_RECV && (sock=rmp->recv.sock)<MAX_SOCKETS &&
             (sp=&sockets[sock])->state==STATE_CONNECTED)
     {
+        sp->last_rx = usec();
         if (sp->handler)
             sp->handler(fd, sock, rmp->recv.dlen);
-        if (rmp->recv.dlen > 0)
+        // Handler may have closed the socket
+        if (rmp->recv.dlen>0 && sp->state==STATE_CONNECTED)
             put_sock_recv(fd, sock);
     }
+    else if (gop==GOP_SEND && (sock=rmp->send.sock)<MAX_SOCKETS &&
+            (sp=&sockets[sock])->state==STATE_CONNECTED)
+    {
+        sp->last_rx = usec();
+        if (sp->sent_handler)
+            sp->sent_handler(fd, sock, rmp->send.sent);
+    }
+    else if (gop==GOP_DNS_RESOLVE)
+        dns_reply(fd, &rmp->dns);
+}
+
+// Start servicing an accepted socket, using its listener's settings
+void sock_connected(int fd, uint8_t sock)
+{
+    SOCKET *sp=&sockets[sock], *lp=&sockets[sp->conn_sock];
+
+    sp->handler = lp->handler;
+    sp->sent_handler = lp->sent_handler;
+    sp->recv_timeout = lp->recv_timeout;
+    sp->idle_timeout = lp->idle_timeout;
+    sp->keepidle = lp->keepidle;
+    sp->keepintvl = lp->keepintvl;
+    sp->keepcnt = lp->keepcnt;
+    sp->last_rx = usec();
+    sock_state(sock, STATE_CONNECTED);
+    put_sock_keepalive(fd, sock);
+    put_sock_recv(fd, sock);
+}
+
+// Set listen backlog (sent to chip), and size of host-side accept queue
+// (0 to service accepted sockets immediately)
+void sock_set_backlog(int sock, uint8_t backlog, uint8_t qsize)
+{
+    if (sock>=0 && sock<MAX_SOCKETS)
+    {
+        sockets[sock].backlog = backlog;
+        sockets[sock].aq_size = MIN(qsize, ACCEPTQ_LEN);
+    }
+}
+
+// Take next connection from listener's accept queue, and start servicing it
+// Return socket number, -ve if none waiting
+int sock_accept(int fd, int sock)
+{
+    SOCKET *sp;
+    int sock2;
+
+    if (sock<0 || sock>=MAX_SOCKETS)
+        return(-1);
+    sp = &sockets[sock];
+    while (sp->aq_count)
+    {
+        sock2 = sp->acceptq[(sp->aq_in + ACCEPTQ_LEN - sp->aq_count) % ACCEPTQ_LEN];
+        sp->aq_count--;
+        if (sockets[sock2].state == STATE_ACCEPTED)
+        {
+            sock_connected(fd, sock2);
+            return(sock2);
+        }
+    }
+    return(-1);
+}
+
+// Display accept statistics for a listening socket
+void sock_listen_stats(int sock)
+{
+    SOCKET *sp=&sockets[sock];
+    uint32_t secs = (usec() - sp->listen_time) / 1000000;
+
+    printf("Sock %d accepts %lu (%lu/min) refusals %lu queued %u\n", sock,
+           sp->accepts, secs ? sp->accepts*60/secs : sp->accepts,
+           sp->refusals, sp->aq_count);
 }
 
 // Change state of socket
@@ -181,6 +340,103 @@ void sock_state(uint8_t sock, int news)
         sockets[sock].state = news;
 }
 
+// Set handler for send completion (called with number of bytes sent,
+// -ve if error). Accepted sockets inherit the handler
+void sock_set_sent_handler(int sock, SOCK_HANDLER handler)
+{
+    if (sock>=0 && sock<MAX_SOCKETS)
+        sockets[sock].sent_handler = handler;
+}
+
+// Set receive timeout (passed to chip) and idle timeout (checked by host)
+// for a socket, in msec; 0 to disable. Accepted sockets inherit settings
+void sock_set_timeouts(int sock, uint32_t recv_ms, uint32_t idle_ms)
+{
+    if (sock>=0 && sock<MAX_SOCKETS)
+    {
+        sockets[sock].recv_timeout = recv_ms;
+        sockets[sock].idle_timeout = idle_ms;
+    }
+}
+
+// Set TCP keepalive for a socket, times in 500 msec units; 0 to disable
+// Accepted sockets inherit settings
+void sock_set_keepalive(int sock, uint16_t idle, uint16_t intvl, uint8_t count)
+{
+    if (sock>=0 && sock<MAX_SOCKETS)
+    {
+        sockets[sock].keepidle = idle;
+        sockets[sock].keepintvl = intvl;
+        sockets[sock].keepcnt = count;
+    }
+}
+
+// Check for idle TCP connections, report timeout to handler, then close
+// (Call regularly from main loop)
+void sock_poll(int fd)
+{
+    static uint32_t poll_ticks;
+    uint32_t t = usec();
+    SOCKET *sp;
+    int sock;
+
+    if (!poll_ticks)
+        ustimeout(&poll_ticks, 0);
+    if (!ustimeout(&poll_ticks, SOCK_POLL_MSEC*1000))
+        return;
+    for (sock=MIN_TCP_SOCK; sock<MAX_TCP_SOCK; sock++)
+    {
+        sp = &sockets[sock];
+        if (sp->state==STATE_CONNECTED && sp->idle_timeout &&
+            t - sp->last_rx > sp->idle_timeout*1000)
+        {
+            if (verbose)
+                printf("Sock %u idle timeout\n", sock);
+            if (sp->handler)
+                sp->handler(fd, sock, SOCK_ERR_TIMEOUT);
+            if (sp->state == STATE_CONNECTED)
+                put_sock_close(fd, sock);
+        }
+    }
+}
+
+// Handle loss of network link: report closure of TCP connections to
+// their handlers, and close them; close server sockets, keeping their
+// settings, so they are bound again when the address is known
+// Return number of server sockets to be restored
+int sock_link_down(int fd)
+{
+    SOCKET *sp, save;
+    int sock, n=0;
+
+    for (sock=MIN_TCP_SOCK; sock<MAX_TCP_SOCK; sock++)
+    {
+        sp = &sockets[sock];
+        if (sp->state==STATE_CONNECTED && sp->handler)
+            sp->handler(fd, sock, SOCK_ERR_CLOSED);
+        if (sp->state==STATE_CONNECTED || sp->state==STATE_ACCEPTED)
+            put_sock_close(fd, sock);
+    }
+    for (sock=MIN_SOCKET; sock<MAX_SOCKETS; sock++)
+    {
+        sp = &sockets[sock];
+        if (sp->state==STATE_BOUND || sp->state==STATE_BINDING)
+        {
+            if (sp->state == STATE_BOUND)
+            {
+                memcpy(&save, sp, sizeof(SOCKET));
+                put_sock_close(fd, sock);
+                memcpy(sp, &save, sizeof(SOCKET));
+            }
+            sp->aq_in = sp->aq_count = 0;
+            sp->session = new_session();
+            sock_state(sock, STATE_BINDING);
+            n++;
+        }
+    }
+    return(n);
+}
+
 // Request to bind a socket
 bool put_sock_bind(int fd, uint8_t sock, uint16_t port)
 {
@@ -196,7 +452,7 @@ bool put_sock_bind(int fd, uint8_t sock, uint16_t port)
 // Request to enable socket listen
 bool put_sock_listen(int fd, uint8_t sock)
 {
-    LISTEN_CMD lc = {sock, 0, sockets[sock].session};
+    LISTEN_CMD lc = {sock, sockets[sock].backlog, sockets[sock].session};
 
     return(hif_put(fd, GOP_LISTEN, &lc, sizeof(lc), 0, 0, 0));
 }
@@ -204,7 +460,8 @@ bool put_sock_listen(int fd, uint8_t sock)
 // Request TCP data from socket
 bool put_sock_recv(int fd, uint8_t sock)
 {
-    RECV_CMD rc = {-1, sock, 0, sockets[sock].session};
+    uint32_t tout = sockets[sock].recv_timeout;
+    RECV_CMD rc = {tout ? tout : -1, sock, 0, sockets[sock].session};
 
     return(hif_put(fd, GOP_RECV, &rc, sizeof(rc), 0, 0, 0));
 }
@@ -212,7 +469,8 @@ bool put_sock_recv(int fd, uint8_t sock)
 // Request UDP data from socket
 bool put_sock_recvfrom(int fd, uint8_t sock)
 {
-    RECVFROM_CMD rc = {-1, sock, 0, sockets[sock].session};
+    uint32_t tout = sockets[sock].recv_timeout;
+    RECVFROM_CMD rc = {tout ? tout : -1, sock, 0, sockets[sock].session};
 
     return(hif_put(fd, GOP_RECVFROM, &rc, sizeof(rc), 0, 0, 0));
 }
@@ -239,6 +497,49 @@ bool put_sock_sendto(int fd, uint8_t sock, void *data, int len)
     return(hif_put(fd, GOP_SENDTO|REQ_DATA, &sc, sizeof(sc), data, len, UDP_DATA_OSET));
 }
 
+// Send a batch of UDP datagrams using socket, return number accepted
+// (Header & data are merged into 1 SPI write per datagram)
+int put_sock_sendto_batch(int fd, uint8_t sock, UDP_DGRAM *dgrams, int n)
+{
+    SOCKET *sp=&sockets[sock];
+    SENDTO_CMD sc = {.sock=sock, .x=0, .session=sp->session, .x2=0};
+    int i;
+
+    for (i=0; i<n; i++)
+    {
+        memcpy(&sc.saddr, &dgrams[i].addr, sizeof(SOCK_ADDR));
+        sc.len = dgrams[i].len;
+        if (!hif_put_merged(fd, GOP_SENDTO|REQ_DATA, &sc, sizeof(sc),
+                            dgrams[i].data, dgrams[i].len, UDP_DATA_OSET))
+            break;
+    }
+    return(i);
+}
+
+// Set socket option
+bool put_sock_setopt(int fd, uint8_t sock, uint8_t opt, uint32_t val)
+{
+    SETSOCKOPT_CMD oc = {val, sock, opt, sockets[sock].session};
+
+    return(hif_put(fd, GOP_SETSOCKOPT, &oc, sizeof(oc), 0, 0, 0));
+}
+
+// Enable TCP keepalive on socket, if configured
+bool put_sock_keepalive(int fd, uint8_t sock)
+{
+    SOCKET *sp=&sockets[sock];
+    bool ok=1;
+
+    if (sp->keepidle)
+    {
+        ok = put_sock_setopt(fd, sock, SO_TCP_KEEPIDLE, sp->keepidle) &&
+             put_sock_setopt(fd, sock, SO_TCP_KEEPINTVL, sp->keepintvl) &&
+             put_sock_setopt(fd, sock, SO_TCP_KEEPCNT, sp->keepcnt) &&
+             put_sock_setopt(fd, sock, SO_TCP_KEEPALIVE, 1);
+    }
+    return(ok);
+}
+
 // Close socket
 bool put_sock_close(int fd, uint8_t sock)
 {
@@ -260,6 +561,17 @@ bool get_sock_data(int fd, uint8_t sock, void *data, int len)
     return(ok);
 }
 
+// Get part of UDP or TCP data from socket, starting at given offset
+bool get_sock_data_oset(int fd, uint8_t sock, int oset, void *data, int len)
+{
+    SOCKET *sp=&sockets[sock];
+    bool ok=0;
+
+    if (len > 0)
+        ok = hif_get(fd, sp->hif_data_addr+oset, data, len);
+    return(ok);
+}
+
 // Handler for TCP echo
 void tcp_echo_handler(int fd, uint8_t sock, int rxlen)
 {
@@ -288,4 +600,53 @@ void udp_echo_handler(int fd, uint8_t sock, int rxlen)
     }
 }
 
+// Handler for UDP send benchmark: any incoming datagram triggers a burst
+// of sends back to the sender. The burst is sent from udp_bench_poll, as
+// sending from here would hold up the receive acknowledgement
+void udp_bench_handler(int fd, uint8_t sock, int rxlen)
+{
+    printf("UDP bench socket %u len %d\n", sock, rxlen);
+    if (rxlen > 0)
+        bench_sock = sock;
+}
+
+// Send UDP benchmark burst if requested: single & batched sends back to
+// the sender, at 3 datagram sizes (call from main loop)
+void udp_bench_poll(int fd)
+{
+    static const int sizes[] = {64, 256, 1400};
+    UDP_DGRAM dgrams[BENCH_BATCH];
+    uint32_t t;
+    int i, j, n, count, save=verbose, sock=bench_sock;
+
+    bench_sock = -1;
+    if (sock<0 || !sockets[sock].state)
+        return;
+    verbose = 0;
+    for (i=0; i<BENCH_BATCH; i++)
+    {
+        memcpy(&dgrams[i].addr, &sockets[sock].addr, sizeof(SOCK_ADDR));
+        dgrams[i].data = databuff;
+    }
+    for (i=0; i<sizeof(sizes)/sizeof(int); i++)
+    {
+        memset(databuff, 'A'+i, sizes[i]);
+        ustimeout(&t, 0);
+        for (n=count=0; n<BENCH_COUNT; n++)
+            count += put_sock_sendto(fd, sock, databuff, sizes[i]);
+        t = usec() - t;
+        printf("Single %4u bytes: %u dgrams in %lu us, %lu dgram/s\n",
+               sizes[i], count, t, (uint32_t)(count * 1000000ULL / (t ? t : 1)));
+        for (j=0; j<BENCH_BATCH; j++)
+            dgrams[j].len = sizes[i];
+        ustimeout(&t, 0);
+        for (n=count=0; n<BENCH_COUNT; n+=BENCH_BATCH)
+            count += put_sock_sendto_batch(fd, sock, dgrams, BENCH_BATCH);
+        t = usec() - t;
+        printf("Batch  %4u bytes: %u dgrams in %lu us, %lu dgram/s\n",
+               sizes[i], count, t, (uint32_t)(count * 1000000ULL / (t ? t : 1)));
+    }
+    verbose = save;
+}
+
 // EOF
@@ -17,6 +17,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "winc_dns.h"
+
 // Socket definitions
 #define UDP_PORTNUM     1025
 #define TCP_PORTNUM     1025
@@ -36,6 +38,33 @@
 #define STATE_ACCEPTED  3
 #define STATE_CONNECTED 4
 
+// Socket handle: socket number in LS byte, session in upper bits
+typedef uint32_t SOCK_HANDLE;
+#define SOCK_HANDLE_NONE            0
+#define SOCK_HANDLE_MAKE(sock, ses) (((uint32_t)(ses) << 8) | (sock))
+#define SOCK_HANDLE_SOCK(h)         ((h) & 0xff)
+#define SOCK_HANDLE_SESSION(h)      ((uint16_t)((h) >> 8))
+
+// Socket error values, as returned in Rx length
+#define SOCK_ERR_CLOSED     -12
+#define SOCK_ERR_TIMEOUT    -13
+
+// TCP keepalive socket options (times in 500 msec units)
+#define SO_TCP_KEEPALIVE    4
+#define SO_TCP_KEEPIDLE     5
+#define SO_TCP_KEEPINTVL    6
+#define SO_TCP_KEEPCNT      7
+
+// Max length of host-side accept queue for a listening socket
+#define ACCEPTQ_LEN         MAX_TCP_SOCK
+
+// Interval between host-side checks for idle sockets (msec)
+#define SOCK_POLL_MSEC      500
+
+// UDP send benchmark: total datagrams per size, datagrams per batch
+#define BENCH_COUNT     200
+#define BENCH_BATCH     20
+
 // Offsets of Tx data, from end of HIF header
 #define UDP_DATA_OSET       68
 #define TCP_DATA_OSET       80
@@ -74,6 +103,21 @@ typedef struct {
     uint16_t session;
 } RECV_RESP_MSG;
 
+// Send response message
+typedef struct {
+    uint8_t sock, x;
+    int16_t sent;
+    uint16_t session, x2;
+} SEND_RESP_MSG;
+
+// Connection info response message (channel needs firmware 19.6 or later)
+typedef struct {
+    char ssid[33];
+    uint8_t sec, ip[4], bssid[6];
+    int8_t rssi;
+    uint8_t chan, x[2];
+} CONN_INFO_RESP_MSG;
+
 // Response message union
 typedef union {
     uint8_t data[16];
@@ -83,21 +127,51 @@ typedef union {
     LISTEN_RESP_MSG listen;
     ACCEPT_RESP_MSG accept;
     RECV_RESP_MSG recv;
+    SEND_RESP_MSG send;
+    DNS_RESP_MSG dns;
+    CONN_INFO_RESP_MSG conn_info;
 } RESP_MSG;
 
+// UDP datagram for batch send; address in network order
+typedef struct {
+    SOCK_ADDR addr;
+    void *data;
+    int len;
+} UDP_DGRAM;
+
 // Storage for socket config
 typedef struct {
     SOCK_ADDR addr;
     uint16_t localport, session;
     int state, conn_sock;
     uint32_t hif_data_addr;
-    SOCK_HANDLER handler;
+    uint32_t recv_timeout, idle_timeout, last_rx;
+    uint16_t keepidle, keepintvl;
+    uint8_t keepcnt;
+    uint8_t backlog, aq_size, aq_in, aq_count, acceptq[ACCEPTQ_LEN];
+    uint32_t accepts, refusals, listen_time;
+    SOCK_HANDLER handler, sent_handler;
 } SOCKET;
 
+extern uint32_t stale_events;
+
 char *sock_err_str(int err);
+uint16_t new_session(void);
+SOCK_HANDLE sock_handle(int sock);
+int sock_from_handle(SOCK_HANDLE h);
+bool sock_session_ok(uint8_t sock, uint16_t session);
 int open_sock_server(int portnum, bool tcp, SOCK_HANDLER handler);
 void interrupt_handler(void);
 void sock_state(uint8_t sock, int news);
+void sock_connected(int fd, uint8_t sock);
+void sock_set_sent_handler(int sock, SOCK_HANDLER handler);
+void sock_set_timeouts(int sock, uint32_t recv_ms, uint32_t idle_ms);
+void sock_set_keepalive(int sock, uint16_t idle, uint16_t intvl, uint8_t count);
+void sock_poll(int fd);
+int sock_link_down(int fd);
+void sock_set_backlog(int sock, uint8_t backlog, uint8_t qsize);
+int sock_accept(int fd, int sock);
+void sock_listen_stats(int sock);
 void check_sock(int fd, uint16_t gop, RESP_MSG *rmp);
 bool put_sock_bind(int fd, uint8_t sock, uint16_t port);
 bool put_sock_listen(int fd, uint8_t sock);
@@ -105,10 +179,16 @@ bool put_sock_recv(int fd, uint8_t sock);
 bool put_sock_recvfrom(int fd, uint8_t sock);
 bool put_sock_send(int fd, uint8_t sock, void *data, int len);
 bool put_sock_sendto(int fd, uint8_t sock, void *data, int len);
+int put_sock_sendto_batch(int fd, uint8_t sock, UDP_DGRAM *dgrams, int n);
+bool put_sock_setopt(int fd, uint8_t sock, uint8_t opt, uint32_t val);
+bool put_sock_keepalive(int fd, uint8_t sock);
 bool put_sock_close(int fd, uint8_t sock);
 bool get_sock_data(int fd, uint8_t sock, void *data, int len);
+bool get_sock_data_oset(int fd, uint8_t sock, int oset, void *data, int len);
 void tcp_echo_handler(int fd, uint8_t sock, int rxlen);
 void udp_echo_handler(int fd, uint8_t sock, int rxlen);
+void udp_bench_handler(int fd, uint8_t sock, int rxlen);
+void udp_bench_poll(int fd);
 
 #endif
 // EOF
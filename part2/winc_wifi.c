@@ -23,7 +23,6 @@
 #include "winc_wifi.h"
 #include "winc_sock.h"
 
-#define NEW_JOIN            0
 #define U16_DATA(d, n, val) {d[n]=val>>8; d[n+1]=val;}
 #define U24_DATA(d, n, val) {d[n]=val>>16; d[n+1]=val>>8; d[n+2]=val;}
 #define U32_DATA(d, n, val) {d[n]=val>>24; d[n+1]=val>>16; d[n+2]=val>>8; d[n+3]=val;}
@@ -32,6 +31,8 @@
 
 uint8_t txbuff[SPI_BUFFLEN], rxbuff[SPI_BUFFLEN];
 int verbose, spi_fd;
+uint32_t fw_version;
+uint8_t chip_mac[6];
 uint8_t tx_zeros[1024];
 bool use_crc=1;
 extern uint32_t spi_speed;
@@ -50,6 +51,8 @@ typedef struct {uint8_t cmd, addr[2], data[4], zeros[2];} CMD_MSG_C;
 typedef struct {uint8_t cmd, addr[3], data[4], zeros[2];} CMD_MSG_D;
 
 // Connection header, 0x30 bytes
+// (SSID field includes options byte & BSSID, after 32-byte SSID)
+#define CONN_SSID_LEN   32
 typedef struct {
     uint16_t cred_size;
     uint8_t flags, chan, ssid_len;
@@ -80,7 +83,11 @@ typedef struct {
 OP_STR wifi_gop_resps[] = {{GOP_CONN_REQ_OLD, "Conn req"}, {GOP_STATE_CHANGE, "State change"},
     {GOP_DHCP_CONF, "DHCP conf"}, {GOP_CONN_REQ_NEW, "Conn_req"}, {GOP_BIND, "Bind"},
     {GOP_LISTEN, "Listen"}, {GOP_ACCEPT, "Accept"}, {GOP_SEND, "Send"}, {GOP_RECV, "Recv"},
-    {GOP_SENDTO, "SendTo"}, {GOP_RECVFROM, "RecvFrom"}, {GOP_CLOSE, "Close"}, {0,""}};
+    {GOP_SENDTO, "SendTo"}, {GOP_RECVFROM, "RecvFrom"}, {GOP_CLOSE, "Close"},
+    {GOP_DNS_RESOLVE, "DNS resolve"}, {GOP_SETSOCKOPT, "SetSockOpt"},
+    {GOP_CONN_INFO, "Conn info"}, {GOP_IP_CONFLICT, "IP conflict"},
+    {GOP_STATIC_IP, "Static IP"}, {GOP_DHCP_ENABLE, "DHCP enable"},
+    {GOP_DHCP_DISABLE, "DHCP disable"}, {0,""}};
 OP_STR wifi_gids[] = {{GID_MAIN, "Main"}, {GID_WIFI, "WiFi"}, {GID_IP, "IP"},
     {GID_HIF, "HIF"}, {0,""}};
 OP_STR wifi_op_reqs[] = {{REQ_DATA, "Data"}, {0,""}};
@@ -365,16 +372,17 @@ bool chip_get_info(int fd)
 {
     uint32_t val;
     uint16_t data[4];
-    uint8_t info[40], mac[6];
+    uint8_t info[40];
     bool ok;
 
     ok = spi_read_reg(fd, NMI_GP_REG2, &val);
     ok = ok && spi_read_data(fd, val|0x30000, (uint8_t *)data, sizeof(data));
     ok = ok && spi_read_data(fd, data[2]|0x30000, info, sizeof(info));
-    ok = ok && spi_read_data(fd, data[1]|0x30000, mac, sizeof(mac));
+    ok = ok && spi_read_data(fd, data[1]|0x30000, chip_mac, sizeof(chip_mac));
+    fw_version = (info[4] << 16) | (info[5] << 8) | info[6];
     printf("Firmware %u.%u.%u, ", info[4], info[5], info[6]);
     printf("OTP MAC address %02X:%02X:%02X:%02X:%02X:%02X\n",
-           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+           chip_mac[0], chip_mac[1], chip_mac[2], chip_mac[3], chip_mac[4], chip_mac[5]);
     return(ok);
 }
 
@@ -422,6 +430,35 @@ bool hif_put(int fd, uint16_t gop, void *dp1, int dlen1, void *dp2, int dlen2, i
     return(ok);
 }
 
+// Send 1 or 2 HIF data blocks, merged with the header into a single SPI write
+// (Same layout as hif_put, but gap between blocks is zero-filled, so
+//  header & data go in 1 transfer; total must fit in SPI buffer)
+bool hif_put_merged(int fd, uint16_t gop, void *dp1, int dlen1, void *dp2, int dlen2, int oset)
+{
+    static uint8_t mbuff[SPI_BUFFLEN];
+    uint32_t addr, dlen = HIF_HDR_SIZE + (dlen2 ? oset+dlen2 : dlen1);
+    uint8_t gid = (uint8_t)(gop>>8), op=(uint8_t)gop;
+    bool ok;
+
+    if (dlen >= SPI_BUFFLEN)
+        return(hif_put(fd, gop, dp1, dlen1, dp2, dlen2, oset));
+    memset(mbuff, 0, HIF_HDR_SIZE + (dlen2 ? oset : dlen1));
+    mbuff[0] = gid;
+    mbuff[1] = op & 0x7f;
+    mbuff[2] = (uint8_t)dlen;
+    mbuff[3] = (uint8_t)(dlen >> 8);
+    memcpy(&mbuff[HIF_HDR_SIZE], dp1, dlen1);
+    if (dp2 && dlen2)
+        memcpy(&mbuff[HIF_HDR_SIZE+oset], dp2, dlen2);
+    ok = hif_start(fd, gid, op, dlen);                      // Start transfer
+    ok = ok && spi_read_reg(fd, RCV_CTRL_REG4, &addr);      // Get DMA addr
+    ok = ok && spi_write_data(fd, addr, mbuff, dlen);       // Write hdr & data
+    ok = ok && spi_write_reg(fd, RCV_CTRL_REG3, addr<<2|2); // Complete transfer
+    if (verbose > 1)
+        printf("Send merged gop=%s(0x%x) len=%d,%d\n", gop_str(gop), gop, dlen1, dlen2);
+    return(ok);
+}
+
 // Receive Host Interface (HIF) header
 int hif_hdr_get(int fd, uint32_t addr, HIF_HDR *hp)
 {
@@ -446,28 +483,60 @@ bool hif_rx_done(int fd)
 // Join a WPA network, or open network if null password
 bool join_net(int fd, char *ssid, char *pass)
 {
-#if NEW_JOIN
-    CONN_HDR ch = {pass?0x98:0x2c, CRED_STORE, ANY_CHAN, strlen(ssid), "",
-                   pass?AUTH_PSK:AUTH_OPEN, {0,0,0}};
-    PSK_DATA pd;
+    return(join_net_chan(fd, ssid, pass, ANY_CHAN, 0));
+}
 
-    strcpy(ch.ssid, ssid);
-    if (pass)
+// Join network on given channel (ANY_CHAN to scan all), and if firmware
+// supports new-style join, only to given BSSID (null if any)
+// Credentials are stored by the firmware
+bool join_net_chan(int fd, char *ssid, char *pass, int chan, uint8_t *bssid)
+{
+    if (fw_version >= NEW_JOIN_VERSION)
     {
-        memset(&pd, 0, sizeof(PSK_DATA));
-        strcpy(pd.phrase, pass);
-        pd.len = strlen(pass);
-        return(hif_put(fd, GOP_CONN_REQ_NEW|REQ_DATA, &ch, sizeof(CONN_HDR),
-               &pd, sizeof(PSK_DATA), sizeof(CONN_HDR)));
+        CONN_HDR ch = {pass?0x98:0x2c, CRED_STORE, chan, strlen(ssid), "",
+                       pass?AUTH_PSK:AUTH_OPEN, {0,0,0}};
+        PSK_DATA pd;
+
+        strcpy(ch.ssid, ssid);
+        if (bssid)
+        {
+            ch.ssid[CONN_SSID_LEN] = CONN_OPT_BSSID;
+            memcpy(&ch.ssid[CONN_SSID_LEN+1], bssid, 6);
+        }
+        if (pass)
+        {
+            memset(&pd, 0, sizeof(PSK_DATA));
+            strcpy(pd.phrase, pass);
+            pd.len = strlen(pass);
+            return(hif_put(fd, GOP_CONN_REQ_NEW|REQ_DATA, &ch, sizeof(CONN_HDR),
+                   &pd, sizeof(PSK_DATA), sizeof(CONN_HDR)));
+        }
+        return(hif_put(fd, GOP_CONN_REQ_NEW, &ch, sizeof(CONN_HDR), 0, 0, 0));
     }
-    return(hif_put(fd, GOP_CONN_REQ_NEW, &ch, sizeof(CONN_HDR), 0, 0, 0));
-#else
-    OLD_CONN_HDR och = {"", pass?AUTH_PSK:AUTH_OPEN, {0,0}, ANY_CHAN, "", 1, {0,0}};
-
-    strcpy(och.ssid, ssid);
-    strcpy(och.psk, pass ? pass : "");
-    return(hif_put(fd, GOP_CONN_REQ_OLD, &och, sizeof(OLD_CONN_HDR), 0, 0, 0));
-#endif
+    else
+    {
+        OLD_CONN_HDR och = {"", pass?AUTH_PSK:AUTH_OPEN, {0,0}, chan, "", 0, {0,0}};
+
+        strcpy(och.ssid, ssid);
+        strcpy(och.psk, pass ? pass : "");
+        return(hif_put(fd, GOP_CONN_REQ_OLD, &och, sizeof(OLD_CONN_HDR), 0, 0, 0));
+    }
+}
+
+// Disconnect from network
+bool leave_net(int fd)
+{
+    uint32_t dummy=0;
+
+    return(hif_put(fd, GOP_DISCONNECT, &dummy, sizeof(dummy), 0, 0, 0));
+}
+
+// Request connection info (SSID, AP address, RSSI, channel)
+bool get_conn_info(int fd)
+{
+    uint32_t dummy=0;
+
+    return(hif_put(fd, GOP_GET_CONN_INFO, &dummy, sizeof(dummy), 0, 0, 0));
 }
 
 // EOF
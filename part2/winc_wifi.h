@@ -62,10 +62,17 @@
 
 // Host Interface operations with Group ID (GID)
 #define GIDOP(gid, op) ((gid << 8) | op)
+#define GOP_GET_CONN_INFO   GIDOP(GID_WIFI, 5)
+#define GOP_CONN_INFO       GIDOP(GID_WIFI, 6)
 #define GOP_CONN_REQ_OLD    GIDOP(GID_WIFI, 40)
+#define GOP_DISCONNECT      GIDOP(GID_WIFI, 43)
 #define GOP_STATE_CHANGE    GIDOP(GID_WIFI, 44)
 #define GOP_DHCP_CONF       GIDOP(GID_WIFI, 50)
+#define GOP_IP_CONFLICT     GIDOP(GID_WIFI, 52)
 #define GOP_CONN_REQ_NEW    GIDOP(GID_WIFI, 59)
+#define GOP_STATIC_IP       GIDOP(GID_IP,   10)
+#define GOP_DHCP_ENABLE     GIDOP(GID_IP,   11)
+#define GOP_DHCP_DISABLE    GIDOP(GID_IP,   12)
 #define GOP_BIND            GIDOP(GID_IP,   65)
 #define GOP_LISTEN          GIDOP(GID_IP,   66)
 #define GOP_ACCEPT          GIDOP(GID_IP,   67)
@@ -74,6 +81,8 @@
 #define GOP_SENDTO          GIDOP(GID_IP,   71)
 #define GOP_RECVFROM        GIDOP(GID_IP,   72)
 #define GOP_CLOSE           GIDOP(GID_IP,   73)
+#define GOP_DNS_RESOLVE     GIDOP(GID_IP,   74)
+#define GOP_SETSOCKOPT      GIDOP(GID_IP,   79)
 
 // HIF header size (in bytes)
 #define HIF_HDR_SIZE        8
@@ -83,6 +92,8 @@
 #define AUTH_PSK        2
 #define CRED_NO_STORE   0
 #define CRED_STORE      3
+#define CONN_OPT_BSSID  1           // New-style join: only connect to given BSSID
+#define NEW_JOIN_VERSION 0x130600   // Min firmware version for new-style join
 #define REQ_DATA        0x80
 
 #define SPI_BUFFLEN     1600
@@ -141,6 +152,13 @@ typedef struct {
     uint16_t session;
 } CLOSE_CMD;
 
+// Set socket option command, 8 bytes
+typedef struct {
+    uint32_t val;
+    uint8_t sock, opt;
+    uint16_t session;
+} SETSOCKOPT_CMD;
+
 typedef void (* SOCK_HANDLER)(int fd, uint8_t sock, int rxlen);
 
 char *op_str(int gid, int op);
@@ -166,11 +184,15 @@ bool chip_init(int fd);
 bool chip_get_info(int fd);
 bool hif_start(int fd, uint8_t gid, uint8_t op, int dlen);
 bool hif_put(int fd, uint16_t gop, void *dp1, int dlen1, void *dp2, int dlen2, int oset);
+bool hif_put_merged(int fd, uint16_t gop, void *dp1, int dlen1, void *dp2, int dlen2, int oset);
 int hif_get(int fd, uint32_t addr, void *buff, int len);
 bool sock_hdr_get(int fd, uint32_t addr, SOCK_ADDR *sap);
 int hif_recv(int fd, uint32_t addr, uint8_t *gidp, uint8_t *opp, void *buff, int maxlen);
 bool hif_rx_done(int fd);
 bool join_net(int fd, char *ssid, char *pass);
+bool join_net_chan(int fd, char *ssid, char *pass, int chan, uint8_t *bssid);
+bool leave_net(int fd);
+bool get_conn_info(int fd);
 bool connect_open(int fd);
 bool connect_psk(int fd);
 bool old_connect_open(int fd);
@@ -189,6 +211,7 @@ int spi_xfer(int fd, uint8_t *txd, uint8_t *rxd, int len);
 void err_exit(char *s);
 
 extern int g_spi_fd;
+extern uint8_t chip_mac[6];     // OTP MAC address, from chip_get_info
 
 #endif
 // EOF